@@ -0,0 +1,78 @@
+#include <iostream>
+#include <cmath>
+#include <memory>
+#include <string>
+#include "embeddedRK.hpp"
+
+using namespace ASC_ode;
+
+// x'' = -x, solution (cos t, -sin t) from (1, 0)
+class Oscillator : public NonlinearFunction
+{
+public:
+    size_t dimX() const override { return 2; }
+    size_t dimF() const override { return 2; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        f(0) = x(1);
+        f(1) = -x(0);
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df = 0.0;
+        df(0,1) = 1;
+        df(1,0) = -1;
+    }
+};
+
+double Error(double t, VectorView<double> y)
+{
+    return std::max(std::fabs(y(0) - std::cos(t)), std::fabs(y(1) + std::sin(t)));
+}
+
+// integrate to tend with rtol = atol = tol; the error at tend and the
+// largest error of the dense output at t = 0, dt, 2 dt, ... must stay
+// within a small multiple of tol, the global error grows like tend tol.
+// Between the steps the interpolation may add at most tol to the error.
+bool Check(const std::string & name, std::shared_ptr<EmbeddedRungeKutta> stepper, double tol)
+{
+    const double tend = 10, dt = 0.05;
+    AdaptiveIntegrator integrator(stepper);
+    integrator.rtol = integrator.atol = tol;
+
+    Vector<> y = { 1.0, 0.0 };
+    double errsteps = 0;
+    integrator.integrate(0, tend, y, [&](double t, VectorView<double> y)
+    {
+        errsteps = std::max(errsteps, Error(t, y));
+    });
+    double errend = Error(tend, y);
+    int accepted = integrator.stats().accepted, rejected = integrator.stats().rejected;
+
+    y = { 1.0, 0.0 };
+    double errdense = 0;
+    int outputs = 0;
+    integrator.integrate(0, tend, dt, y, [&](double t, VectorView<double> y)
+    {
+        errdense = std::max(errdense, Error(t, y));
+        outputs++;
+    });
+
+    std::cout << name << ", tol " << tol << ": " << accepted << " steps, " << rejected
+              << " rejected, error at tend " << errend << ", at the steps " << errsteps
+              << ", dense output " << errdense << " at " << outputs << " points\n";
+    return errend < 10*tend*tol && errsteps < 10*tend*tol && errdense < errsteps + tol
+        && outputs == 201 && rejected < accepted;
+}
+
+int main()
+{
+    auto rhs = std::make_shared<Oscillator>();
+    bool ok = true;
+    for (double tol : { 1e-5, 1e-8 }) {
+        ok = Check("BogackiShampine32", BogackiShampine32(rhs), tol) && ok;
+        ok = Check("DormandPrince54", DormandPrince54(rhs), tol) && ok;
+    }
+    std::cout << (ok ? "adaptive integration meets the tolerance\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <cmath>
+#include "autodifffunc.hpp"
+
+using namespace ASC_ode;
+
+int main()
+{
+    // 5 unknowns seeded in blocks of 2, so the last block is partial
+    auto func = MakeAutoDiffFunction<2>(5, 3, [](auto x, auto f)
+    {
+        f(0) = x(0)*x(1) + sin(x(2));
+        f(1) = exp(x(3)) - x(4)*x(4)*x(0);
+        f(2) = x(1)/x(4) + cos(x(0)*x(3));
+    });
+
+    Vector<> x = { 0.3, -1.2, 0.7, 0.4, 1.5 };
+
+    // analytic Jacobian
+    Matrix<> exact(3, 5);
+    exact = 0.0;
+    exact(0,0) = x(1);
+    exact(0,1) = x(0);
+    exact(0,2) = std::cos(x(2));
+    exact(1,0) = -x(4)*x(4);
+    exact(1,3) = std::exp(x(3));
+    exact(1,4) = -2*x(4)*x(0);
+    exact(2,0) = -std::sin(x(0)*x(3)) * x(3);
+    exact(2,1) = 1/x(4);
+    exact(2,3) = -std::sin(x(0)*x(3)) * x(0);
+    exact(2,4) = -x(1)/(x(4)*x(4));
+
+    Matrix<> df(3, 5), dfw(3, 5);
+    Vector<> f(3), fw(3);
+    func->evaluate(x, f);
+    func->evaluateDeriv(x, df);
+    func->evaluateWithDeriv(x, fw, dfw);
+
+    double errjac = 0, errwith = 0;
+    for (size_t i = 0; i < 3; i++) {
+        errwith = std::max(errwith, std::fabs(fw(i) - f(i)));
+        for (size_t j = 0; j < 5; j++) {
+            errjac = std::max(errjac, std::fabs(df(i,j) - exact(i,j)));
+            errwith = std::max(errwith, std::fabs(dfw(i,j) - exact(i,j)));
+        }
+    }
+
+    // directional derivative against the analytic Jacobian times v
+    Vector<> v = { 1.0, -0.5, 0.25, 2.0, -1.0 };
+    Vector<> jv(3);
+    func->evaluateJv(x, v, jv);
+    double errjv = 0;
+    for (size_t i = 0; i < 3; i++) {
+        double sum = 0;
+        for (size_t j = 0; j < 5; j++)
+            sum += exact(i,j) * v(j);
+        errjv = std::max(errjv, std::fabs(jv(i) - sum));
+    }
+
+    std::cout << "AutoDiffFunction Jacobian, max error vs analytic = " << errjac << "\n";
+    std::cout << "evaluateWithDeriv, max error = " << errwith << "\n";
+    std::cout << "evaluateJv, max error = " << errjv << "\n";
+
+    bool ok = errjac < 1e-13 && errwith < 1e-13 && errjv < 1e-13;
+    std::cout << (ok ? "AutoDiff derivatives agree\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
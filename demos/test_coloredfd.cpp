@@ -0,0 +1,94 @@
+#include <iostream>
+#include <cmath>
+#include <memory>
+#include "coloredfd.hpp"
+
+using namespace ASC_ode;
+
+// discrete Bratu-type chain with an extra coupling two back:
+// f_i = x_{i-1} - 2 x_i + x_{i+1} + 0.1 exp(x_i) + 0.05 x_{i-2}^2
+// lower bandwidth 2, upper 1, so columns up to 3 apart share a row
+class Chain : public NonlinearFunction
+{
+    size_t m_n;
+public:
+    Chain(size_t n) : m_n(n) {}
+
+    size_t dimX() const override { return m_n; }
+    size_t dimF() const override { return m_n; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        for (size_t i = 0; i < m_n; i++) {
+            f(i) = -2*x(i) + 0.1*std::exp(x(i));
+            if (i >= 1) f(i) += x(i-1);
+            if (i >= 2) f(i) += 0.05*x(i-2)*x(i-2);
+            if (i+1 < m_n) f(i) += x(i+1);
+        }
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df = 0.0;
+        for (size_t i = 0; i < m_n; i++) {
+            df(i,i) = -2 + 0.1*std::exp(x(i));
+            if (i >= 1) df(i,i-1) = 1;
+            if (i >= 2) df(i,i-2) = 0.1*x(i-2);
+            if (i+1 < m_n) df(i,i+1) = 1;
+        }
+    }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern(SparsityPattern & pattern) const override
+    {
+        for (size_t i = 0; i < m_n; i++)
+            for (size_t j = (i >= 2 ? i-2 : 0); j <= std::min(i+1, m_n-1); j++)
+                pattern.add(i, j);
+    }
+};
+
+// max entry error of the coloured Jacobian against the analytic one
+double JacobianError(const ColoredFDFunction & fd, const NonlinearFunction & func, VectorView<double> x)
+{
+    size_t n = func.dimX();
+    Matrix<> exact(n, n), df(n, n);
+    func.evaluateDeriv(x, exact);
+    fd.evaluateDeriv(x, df);
+
+    SparseMatrix sparse(fd.derivPattern());
+    fd.evaluateDerivSparse(x, sparse);
+    const SparseMatrix & csparse = sparse;   // zero outside the pattern
+
+    double err = 0;
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < n; j++) {
+            err = std::max(err, std::fabs(df(i,j) - exact(i,j)));
+            err = std::max(err, std::fabs(csparse(i,j) - exact(i,j)));
+        }
+    return err;
+}
+
+int main()
+{
+    const size_t n = 40;
+    auto func = std::make_shared<Chain>(n);
+    Vector<> x(n);
+    for (size_t i = 0; i < n; i++)
+        x(i) = std::sin(1.0 + 0.7*i);
+
+    // pattern from the function, and probed at x
+    ColoredFDFunction given(func, func->derivPattern());
+    ColoredFDFunction probed(func, x);
+
+    double errgiven = JacobianError(given, *func, x);
+    double errprobed = JacobianError(probed, *func, x);
+
+    std::cout << "given pattern: " << given.numColors() << " colours, max error vs analytic = "
+              << errgiven << "\n";
+    std::cout << "probed pattern: " << probed.numColors() << " colours, max error vs analytic = "
+              << errprobed << "\n";
+
+    // 4 evaluations instead of 40, with first order differences of step
+    // sqrt(eps) the error is about 1e-8 times the second derivatives
+    bool ok = given.numColors() == 4 && probed.numColors() == 4
+        && errgiven < 1e-6 && errprobed < 1e-6;
+    std::cout << (ok ? "coloured differences agree\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
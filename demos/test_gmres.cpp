@@ -0,0 +1,53 @@
+#include <iostream>
+#include <cmath>
+#include "Newton.hpp"
+
+using namespace ASC_ode;
+
+int main()
+{
+    // 1D convection-diffusion, non-symmetric tridiagonal matrix
+    const size_t n = 50;
+    Matrix<> a(n, n);
+    a = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        a(i,i) = 2.5;
+        if (i >= 1) a(i,i-1) = -1.3;
+        if (i+1 < n) a(i,i+1) = -0.7;
+    }
+    Vector<> b(n);
+    for (size_t i = 0; i < n; i++)
+        b(i) = 1.0 + std::cos(0.3*i);
+
+    auto apply = [&](VectorView<double> x, VectorView<double> y)
+    {
+        for (size_t i = 0; i < n; i++) {
+            double sum = 0;
+            for (size_t j = 0; j < n; j++)
+                sum += a(i,j) * x(j);
+            y(i) = sum;
+        }
+    };
+
+    Vector<> ref = b;
+    DenseLU<> lu(a);
+    lu.solve(ref);
+
+    bool ok = true;
+    // full GMRES, and restarted every 10 iterations
+    for (int restart : { 50, 10 }) {
+        Vector<> x(n);
+        x = 0.0;
+        int its = GMRES(apply, b, x, 1e-12, restart, 1000);
+
+        double err = 0;
+        for (size_t i = 0; i < n; i++)
+            err = std::max(err, std::fabs(x(i) - ref(i)));
+        std::cout << "GMRES(" << restart << "): " << its << " iterations, max error vs DenseLU = " << err << "\n";
+        if (!(err < 1e-9))
+            ok = false;
+    }
+
+    std::cout << (ok ? "GMRES agrees with DenseLU\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include "timestepper.hpp"
+
+using namespace ASC_ode;
+
+// y' = 1 up to the barrier y = 1.05, not defined beyond: every implicit
+// Euler step ending past the barrier fails in the Newton iteration
+class Barrier : public NonlinearFunction
+{
+public:
+    size_t dimX() const override { return 1; }
+    size_t dimF() const override { return 1; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        f(0) = x(0) < 1.05 ? 1.0 : std::numeric_limits<double>::quiet_NaN();
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df(0,0) = 0;
+    }
+};
+
+int main()
+{
+    ImplicitEuler stepper(std::make_shared<Barrier>());
+    bool ok = true;
+
+    // a step staying below the barrier
+    Vector<> y = { 1.0 };
+    stepper.doStep(0.04, y);
+    std::cout << "step of 0.04: y = " << y(0) << "\n";
+    if (!(std::fabs(y(0) - 1.04) < 1e-14))
+        ok = false;
+
+    // a step across the barrier: the halved steps advance y up to the
+    // barrier, then the smallest step fails, the state must be restored
+    y(0) = 1.0;
+    bool thrown = false;
+    try
+    {
+        stepper.doStep(1.0, y);
+    }
+    catch (std::domain_error & e)
+    {
+        thrown = true;
+        std::cout << "step of 1: " << e.what() << "\n";
+    }
+    std::cout << "y after the failed step = " << y(0) << "\n";
+    if (!thrown || y(0) != 1.0)
+        ok = false;
+
+    std::cout << (ok ? "failed step leaves the state unchanged\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
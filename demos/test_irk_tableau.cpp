@@ -0,0 +1,77 @@
+#include <iostream>
+#include <cmath>
+#include "implicitRK.hpp"
+
+using namespace ASC_ode;
+
+// x'' = -x, solution (cos t, -sin t) from (1, 0)
+class Oscillator : public NonlinearFunction
+{
+public:
+    size_t dimX() const override { return 2; }
+    size_t dimF() const override { return 2; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        f(0) = x(1);
+        f(1) = -x(0);
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df = 0.0;
+        df(0,1) = 1;
+        df(1,0) = -1;
+    }
+};
+
+int main()
+{
+    auto rhs = std::make_shared<Oscillator>();
+    const double tau = 0.1;
+    bool ok = true;
+
+    // Gauss 3: a collocation method, dense output from the collocation polynomial
+    auto [a3, b3] = computeABfromC(Gauss3c);
+    ImplicitRungeKutta gauss3(rhs, a3, b3, Gauss3c);
+    gauss3.enableDenseOutput();
+    Vector<> y = { 1.0, 0.0 };
+    gauss3.doStep(tau, y);
+    Vector<> ymid(2);
+    gauss3.denseOutput(0.5, ymid);
+    double errgauss = std::fabs(ymid(0) - std::cos(0.5*tau));
+    std::cout << "Gauss3 dense output error at tau/2 = " << errgauss << "\n";
+    if (!(errgauss < 1e-6))
+        ok = false;
+
+    // implicit midpoint rule written as a DIRK with the repeated node 1/2:
+    // not a collocation method, the construction must not invert the
+    // singular Vandermonde matrix
+    Matrix<> arep = { { 0.5, 0 }, { 0, 0.5 } };
+    Vector<> brep = { 0.5, 0.5 };
+    Vector<> crep = { 0.5, 0.5 };
+    ImplicitRungeKutta repeated(rhs, arep, brep, crep);
+    repeated.enableDenseOutput();
+
+    Vector<> cmid = { 0.5 };
+    auto [amid, bmid] = computeABfromC(cmid);
+    ImplicitRungeKutta midpoint(rhs, amid, bmid, cmid);
+
+    Vector<> yrep = { 1.0, 0.0 }, ymp = { 1.0, 0.0 };
+    repeated.doStep(tau, yrep);
+    midpoint.doStep(tau, ymp);
+    double errstep = std::max(std::fabs(yrep(0) - ymp(0)), std::fabs(yrep(1) - ymp(1)));
+    std::cout << "repeated node vs implicit midpoint, step difference = " << errstep << "\n";
+    if (!(errstep < 1e-12))
+        ok = false;
+
+    // dense output falls back to Hermite interpolation
+    Vector<> yd(2), yh(2);
+    repeated.denseOutput(0.5, yd);
+    repeated.TimeStepper::denseOutput(0.5, yh);
+    double errdense = std::max(std::fabs(yd(0) - yh(0)), std::fabs(yd(1) - yh(1)));
+    std::cout << "repeated node dense output vs Hermite = " << errdense << "\n";
+    if (!(errdense == 0))
+        ok = false;
+
+    std::cout << (ok ? "IRK tableau checks passed\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+#include <iostream>
+#include <cmath>
+#include <memory>
+#include <string>
+#include "linearsolver.hpp"
+
+using namespace ASC_ode;
+
+// f(x) = A x - b, the Jacobian pattern are the nonzeros of A
+class LinearSystem : public NonlinearFunction
+{
+    Matrix<> m_a;
+    Vector<> m_b;
+public:
+    LinearSystem(const Matrix<> & a, const Vector<> & b) : m_a(a), m_b(b) {}
+
+    size_t dimX() const override { return m_b.size(); }
+    size_t dimF() const override { return m_b.size(); }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        for (size_t i = 0; i < dimF(); i++) {
+            double sum = -m_b(i);
+            for (size_t j = 0; j < dimX(); j++)
+                sum += m_a(i,j) * x(j);
+            f(i) = sum;
+        }
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df = m_a;
+    }
+    bool isAffine() const override { return true; }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern(SparsityPattern & pattern) const override
+    {
+        for (size_t i = 0; i < dimF(); i++)
+            for (size_t j = 0; j < dimX(); j++)
+                if (m_a(i,j) != 0)
+                    pattern.add(i, j);
+    }
+};
+
+// max error of the solution of A x = b by solver against DenseLU
+double SolveError(LinearSolver & solver, const Matrix<> & a, const Vector<> & b)
+{
+    size_t n = b.size();
+    LinearSystem sys(a, b);
+    Vector<> x(n), f(n);
+    x = 0.0;
+    solver.assemble(sys, x, f);
+    solver.factor();
+    solver.solve(f);            // A^{-1} (A 0 - b) = -x
+
+    Vector<> ref = b;
+    DenseLU<> lu(a);
+    lu.solve(ref);
+
+    double err = 0;
+    for (size_t i = 0; i < n; i++)
+        err = std::max(err, std::fabs(f(i) + ref(i)));
+    return err;
+}
+
+// the backend picked by ChooseLinearSolver
+std::string SolverName(const std::shared_ptr<LinearSolver> & solver)
+{
+    if (std::dynamic_pointer_cast<SmallLUSolver<6>>(solver)) return "SmallLU";
+    if (std::dynamic_pointer_cast<BandedLUSolver>(solver)) return "BandedLU";
+    if (std::dynamic_pointer_cast<DenseLUSolver>(solver)) return "DenseLU";
+    return "other";
+}
+
+int main()
+{
+    const size_t n = 30;
+    Vector<> b(n);
+    for (size_t i = 0; i < n; i++)
+        b(i) = std::sin(1.0 + i);
+
+    // banded: two subdiagonals, one superdiagonal
+    Matrix<> band(n, n);
+    band = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        band(i,i) = 4;
+        if (i >= 1) band(i,i-1) = -1;
+        if (i >= 2) band(i,i-2) = 0.5;
+        if (i+1 < n) band(i,i+1) = -1.5;
+    }
+
+    // block diagonal with non-symmetric 3x3 blocks
+    Matrix<> block(n, n);
+    block = 0.0;
+    for (size_t k = 0; k < n; k += 3)
+        for (size_t p = 0; p < 3; p++)
+            for (size_t q = 0; q < 3; q++)
+                block(k+p, k+q) = 1.0 / (1+p+2*q) + (p == q ? 2 : 0);
+
+    // general sparse: scattered couplings, diagonally dominant
+    Matrix<> sparse(n, n);
+    sparse = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        sparse(i,i) = 10;
+        sparse(i, (7*i+3) % n) += std::sin(1.0 + i);
+        sparse(i, (13*i+5) % n) += std::cos(2.0 + i);
+    }
+
+    // zero diagonal: an LU without pivoting breaks down at the first row
+    Matrix<> cyclic(n, n);
+    cyclic = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        cyclic(i, (i+1) % n) = 3;
+        cyclic(i, (i+4) % n) = 1;
+    }
+
+    // band rows of 2*3+1+1 = 8 entries, more than n / BandedLUMinRatio
+    Matrix<> wide = band;
+    for (size_t i = 3; i < n; i++)
+        wide(i,i-3) = 0.25;
+
+    // tiny dense system
+    const size_t nsmall = 6;
+    Matrix<> small(nsmall, nsmall);
+    Vector<> bsmall(nsmall);
+    for (size_t i = 0; i < nsmall; i++) {
+        bsmall(i) = b(i);
+        for (size_t j = 0; j < nsmall; j++)
+            small(i,j) = (i == j ? nsmall+1.0 : std::sin(1.0 + i + 2*j));
+    }
+
+    // one solver for several systems in turn: the stored ordering must
+    // follow the pattern, also if the functions share an address
+    auto shared = std::make_shared<SparseLUSolver>();
+
+    struct Case { std::string name; std::shared_ptr<LinearSolver> solver; const Matrix<> & a; };
+    Case cases[] = {
+        { "banded / BandedLU", std::make_shared<BandedLUSolver>(), band },
+        { "banded / SparseLU", std::make_shared<SparseLUSolver>(), band },
+        { "block diagonal / BandedLU", std::make_shared<BandedLUSolver>(), block },
+        { "block diagonal / SparseLU", std::make_shared<SparseLUSolver>(), block },
+        { "general sparse / SparseLU", std::make_shared<SparseLUSolver>(), sparse },
+        { "general sparse / DenseLU", std::make_shared<DenseLUSolver>(), sparse },
+        { "general sparse / MixedLU", std::make_shared<MixedLUSolver>(), sparse },
+        { "banded / MixedLU", std::make_shared<MixedLUSolver>(), band },
+        { "zero diagonal / SparseLU", std::make_shared<SparseLUSolver>(), cyclic },
+        { "banded / shared SparseLU", shared, band },
+        { "general sparse / shared SparseLU", shared, sparse },
+        { "block diagonal / shared SparseLU", shared, block },
+    };
+
+    bool ok = true;
+    for (auto & c : cases) {
+        double err = SolveError(*c.solver, c.a, b);
+        std::cout << c.name << ": max error vs DenseLU = " << err << "\n";
+        if (!(err < 1e-12))
+            ok = false;
+    }
+
+    // automatic choice: every branch of ChooseLinearSolver, the chosen
+    // solver must agree with DenseLU as well
+    struct Choice { std::string name; const Matrix<> & a; const Vector<> & b; std::string expected; };
+    Choice choices[] = {
+        { "6x6 dense", small, bsmall, "SmallLU" },
+        { "banded, 6 per row", band, b, "BandedLU" },
+        { "banded, 8 per row", wide, b, "DenseLU" },
+        { "general sparse", sparse, b, "DenseLU" },
+    };
+    for (auto & c : choices) {
+        LinearSystem sys(c.a, c.b);
+        auto solver = ChooseLinearSolver(sys);
+        double err = SolveError(*solver, c.a, c.b);
+        std::cout << "ChooseLinearSolver, " << c.name << ": " << SolverName(solver)
+                  << ", max error vs DenseLU = " << err << "\n";
+        if (SolverName(solver) != c.expected || !(err < 1e-12))
+            ok = false;
+    }
+
+    std::cout << (ok ? "all solvers agree\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#include <iostream>
+#include <cmath>
+#include <memory>
+#include <string>
+#include "timestepper.hpp"
+
+using namespace ASC_ode;
+
+// logistic equation y' = y (1-y), y(t) = 1 / (1 + (1/y0 - 1) e^{-t})
+class Logistic : public NonlinearFunction
+{
+public:
+    size_t dimX() const override { return 1; }
+    size_t dimF() const override { return 1; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        f(0) = x(0) * (1 - x(0));
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df(0,0) = 1 - 2*x(0);
+    }
+};
+
+double Exact(double t, double y0) { return 1 / (1 + (1/y0 - 1) * std::exp(-t)); }
+
+// error at tend with n and 2n steps, the observed order is log2 of their ratio
+double ObservedOrder(TimeStepper & stepper, double tend, int n, double & error)
+{
+    double y0 = 0.2, err[2];
+    for (int k = 0; k < 2; k++) {
+        int steps = n << k;
+        Vector<> y = { y0 };
+        for (int i = 0; i < steps; i++)
+            stepper.doStep(tend / steps, y);
+        err[k] = std::fabs(y(0) - Exact(tend, y0));
+    }
+    error = err[1];
+    return std::log2(err[0] / err[1]);
+}
+
+int main()
+{
+    auto rhs = std::make_shared<Logistic>();
+    const double tend = 2;
+    const int n = 20;
+
+    LowStorageRK3 ls3(rhs);
+    LowStorageRK4 ls4(rhs);
+    RungeKutta4 rk4(rhs);
+
+    double err3, err4, errrk4;
+    double p3 = ObservedOrder(ls3, tend, n, err3);
+    double p4 = ObservedOrder(ls4, tend, n, err4);
+    double prk4 = ObservedOrder(rk4, tend, n, errrk4);
+
+    std::cout << "LowStorageRK3: order " << p3 << ", error " << err3 << "\n";
+    std::cout << "LowStorageRK4: order " << p4 << ", error " << err4 << "\n";
+    std::cout << "RungeKutta4:   order " << prk4 << ", error " << errrk4 << "\n";
+
+    // LowStorageRK4 uses 5 stages per step, it must be at least as
+    // accurate as RK4 with 4 stages at the same step size
+    bool ok = std::fabs(p3 - 3) < 0.3 && std::fabs(p4 - 4) < 0.3 && std::fabs(prk4 - 4) < 0.3
+        && err4 <= errrk4;
+
+    std::cout << (ok ? "low-storage schemes converge with their order\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
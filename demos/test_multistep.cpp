@@ -0,0 +1,101 @@
+#include <iostream>
+#include <cmath>
+#include <memory>
+#include <string>
+#include "multistep.hpp"
+
+using namespace ASC_ode;
+
+// x'' = -x, solution (cos t, -sin t) from (1, 0)
+class Oscillator : public NonlinearFunction
+{
+public:
+    size_t dimX() const override { return 2; }
+    size_t dimF() const override { return 2; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        f(0) = x(1);
+        f(1) = -x(0);
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df = 0.0;
+        df(0,1) = 1;
+        df(1,0) = -1;
+    }
+};
+
+double Error(double t, VectorView<double> y)
+{
+    return std::max(std::fabs(y(0) - std::cos(t)), std::fabs(y(1) + std::sin(t)));
+}
+
+// error at tend with n and 2n fixed steps, the observed order is log2 of
+// their ratio; reset starts a new history for every run
+template <typename STEPPER>
+double ObservedOrder(STEPPER & stepper, double tend, int n, double & error)
+{
+    double err[2];
+    for (int k = 0; k < 2; k++) {
+        int steps = n << k;
+        stepper.reset();
+        Vector<> y = { 1.0, 0.0 };
+        for (int i = 0; i < steps; i++)
+            stepper.doStep(tend / steps, y);
+        err[k] = Error(tend, y);
+    }
+    error = err[1];
+    return std::log2(err[0] / err[1]);
+}
+
+int main()
+{
+    auto rhs = std::make_shared<Oscillator>();
+    const double tend = 4;
+    bool ok = true;
+
+    // fixed steps, the first ones by the RK4 startup
+    AdamsBashforthMoulton abm(rhs, 4);
+    double errabm;
+    double pabm = ObservedOrder(abm, tend, 40, errabm);
+    std::cout << "ABM4: order " << pabm << ", error " << errabm << "\n";
+    if (!(std::fabs(pabm - 4) < 0.3))
+        ok = false;
+
+    // fixed steps at order 1 ... 5; the startup fills the history with
+    // error controlled steps, tight enough not to show in the error
+    for (int q = 1; q <= 5; q++) {
+        BDF bdf(rhs);
+        bdf.maxorder = q;
+        bdf.rtol = bdf.atol = 1e-10;
+        double err;
+        double p = ObservedOrder(bdf, tend, 40, err);
+        std::cout << "BDF" << q << ": order " << p << ", error " << err << "\n";
+        if (!(std::fabs(p - q) < 0.3))
+            ok = false;
+    }
+
+    // variable step size and order: the error must follow the tolerance.
+    // The controller only bounds the local error estimate, on the
+    // oscillator the global error is some 10 to 100 times tol.
+    double errprev = 1;
+    for (double tol : { 1e-4, 1e-6, 1e-8 }) {
+        BDF bdf(rhs);
+        bdf.rtol = bdf.atol = tol;
+        Vector<> y = { 1.0, 0.0 };
+        int maxorder = 0;
+        bdf.integrate(0, tend, y, [&](double t, VectorView<double> y)
+        {
+            maxorder = std::max(maxorder, bdf.order());
+        });
+        double err = Error(tend, y);
+        std::cout << "variable-order BDF, tol " << tol << ": " << bdf.stats().accepted
+                  << " steps, up to order " << maxorder << ", error " << err << "\n";
+        if (!(err < 100*tend*tol) || !(err < 0.1*errprev) || maxorder != 5)
+            ok = false;
+        errprev = err;
+    }
+
+    std::cout << (ok ? "multistep methods converge with their order\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
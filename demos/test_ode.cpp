@@ -5,6 +5,8 @@
 #include "nonlinfunc.hpp"
 #include "timestepper.hpp"
 #include "implicitRK.hpp"
+#include "embeddedRK.hpp"
+#include "multistep.hpp"
 #include "massspring.cpp"
 
 using namespace ASC_ode;
@@ -34,6 +36,19 @@ int main(int argc, char* argv[])
     // ========================================================
     std::unique_ptr<TimeStepper> stepper;
 
+    // adaptive embedded pairs, output every tau from the dense output
+    if (algorithm == "BS32" || algorithm == "DP54")
+    {
+        AdaptiveIntegrator integrator(algorithm == "BS32" ? BogackiShampine32(rhs)
+                                                          : DormandPrince54(rhs));
+        integrator.rtol = integrator.atol = 1e-8;
+        integrator.integrate(0, tend, tau, y, [](double t, VectorView<double> y)
+        {
+            std::cout << t << "  " << y(0) << " " << y(1) << std::endl;
+        });
+        return 0;
+    }
+
     if (algorithm == "explicit")
         stepper = std::make_unique<ExplicitEuler>(rhs);
     else if (algorithm == "improved")
@@ -44,9 +59,13 @@ int main(int argc, char* argv[])
         stepper = std::make_unique<CrankNicolson>(rhs);
     else if (algorithm == "RK2")
         stepper = std::make_unique<RungeKutta2>(rhs);
+    else if (algorithm == "ABM")
+        stepper = std::make_unique<AdamsBashforthMoulton>(rhs);
+    else if (algorithm == "BDF")
+        stepper = std::make_unique<BDF>(rhs);
     else
     {
-        std::cout << "Choose method: explicit / improved / implicit / CN / RK2\n";
+        std::cout << "Choose method: explicit / improved / implicit / CN / RK2 / ABM / BDF / BS32 / DP54\n";
         return 1;
     }
 
@@ -0,0 +1,127 @@
+#include <iostream>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "nonlinfunc.hpp"
+#include "coloredfd.hpp"
+
+using namespace ASC_ode;
+
+// cyclic chain f_i = sin(x_i) x_{i+1} + exp(-x_i^2), no scratch memory
+class Ring : public NonlinearFunction
+{
+    size_t m_n;
+    bool m_threadsafe;
+public:
+    Ring(size_t n, bool threadsafe) : m_n(n), m_threadsafe(threadsafe) {}
+
+    size_t dimX() const override { return m_n; }
+    size_t dimF() const override { return m_n; }
+    bool isThreadSafe() const override { return m_threadsafe; }
+    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    {
+        for (size_t i = 0; i < m_n; i++)
+            f(i) = std::sin(x(i)) * x((i+1) % m_n) + std::exp(-x(i)*x(i));
+    }
+    void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
+    {
+        df = 0.0;
+        for (size_t i = 0; i < m_n; i++) {
+            df(i,i) = std::cos(x(i)) * x((i+1) % m_n) - 2*x(i)*std::exp(-x(i)*x(i));
+            df(i,(i+1) % m_n) += std::sin(x(i));
+        }
+    }
+};
+
+// number of entries in which a and b differ
+size_t Differences(const Matrix<> & a, const Matrix<> & b)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < a.rows(); i++)
+        for (size_t j = 0; j < a.cols(); j++)
+            if (a(i,j) != b(i,j))
+                count++;
+    return count;
+}
+
+size_t Differences(const Vector<> & a, const Vector<> & b)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a(i) != b(i))
+            count++;
+    return count;
+}
+
+int main()
+{
+    // blocks of ParallelMinDim + 8 unknowns, so the thread safe variant
+    // takes the thread pool; the blocks write disjoint ranges, the results
+    // must be bitwise the same as on the serial path
+    const size_t n = ParallelMinDim + 8, num = 8, batch = 3;
+    MultipleFunc parallel(std::make_shared<Ring>(n, true), num);
+    MultipleFunc serial(std::make_shared<Ring>(n, false), num);
+    std::cout << "thread pool with " << DefaultThreadPool().numThreads() << " threads\n";
+
+    size_t dim = n * num;
+    Vector<> x(dim), fp(dim), fs(dim), fwp(dim), fws(dim);
+    for (size_t i = 0; i < dim; i++)
+        x(i) = std::sin(1.0 + 0.37*i);
+    Matrix<> dfp(dim, dim), dfs(dim, dim), dfwp(dim, dim), dfws(dim, dim);
+
+    parallel.evaluate(x, fp);
+    serial.evaluate(x, fs);
+    parallel.evaluateDeriv(x, dfp);
+    serial.evaluateDeriv(x, dfs);
+    parallel.evaluateWithDeriv(x, fwp, dfwp);
+    serial.evaluateWithDeriv(x, fws, dfws);
+
+    // batch of states, column by column through the parallel evaluate
+    Matrix<> xb(dim, batch), fbp(dim, batch), fbs(dim, batch);
+    for (size_t i = 0; i < dim; i++)
+        for (size_t j = 0; j < batch; j++)
+            xb(i,j) = std::cos(0.5 + 0.11*i + j);
+    parallel.evaluateBatch(xb, fbp);
+    serial.evaluateBatch(xb, fbs);
+
+    size_t diffeval = Differences(fp, fs);
+    size_t diffderiv = Differences(dfp, dfs);
+    size_t diffwith = Differences(fwp, fws) + Differences(dfwp, dfws);
+    size_t diffbatch = Differences(fbp, fbs);
+
+    // coloured differences: the colours are evaluated in parallel
+    auto ringp = std::make_shared<Ring>(dim, true);
+    auto rings = std::make_shared<Ring>(dim, false);
+    ColoredFDFunction fdp(ringp, x), fds(rings, x);
+    Matrix<> jp(dim, dim), js(dim, dim);
+    fdp.evaluateDeriv(x, jp);
+    fds.evaluateDeriv(x, js);
+    size_t difffd = Differences(jp, js);
+
+    std::cout << "MultipleFunc evaluate, differing entries = " << diffeval << "\n";
+    std::cout << "MultipleFunc evaluateDeriv, differing entries = " << diffderiv << "\n";
+    std::cout << "MultipleFunc evaluateWithDeriv, differing entries = " << diffwith << "\n";
+    std::cout << "MultipleFunc evaluateBatch, differing entries = " << diffbatch << "\n";
+    std::cout << "ColoredFDFunction, " << fdp.numColors() << " colours, differing entries = "
+              << difffd << "\n";
+
+    // the pool itself with more workers than cores: every index once
+    ThreadPool pool(4);
+    std::vector<int> visits(1000, 0);
+    std::atomic<bool> threadsok = true;
+    pool.parallelFor(visits.size(), [&](size_t i, size_t thread)
+    {
+        visits[i]++;
+        if (thread >= pool.numThreads()) threadsok = false;
+    });
+    size_t missed = 0;
+    for (int v : visits)
+        if (v != 1) missed++;
+    std::cout << "ThreadPool(4), indices not visited exactly once = " << missed << "\n";
+
+    bool ok = diffeval == 0 && diffderiv == 0 && diffwith == 0 && diffbatch == 0
+        && difffd == 0 && missed == 0 && threadsok;
+    std::cout << (ok ? "parallel and serial paths agree\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include "linearsolver.hpp"
+
+using namespace ASC_ode;
+
+// factor and solve a well-conditioned N x N system many times with
+// SmallLU<N> and DenseLU; the solutions must agree, the times are reported
+template <size_t N>
+bool Compare(int reps)
+{
+    std::array<double,N*N> a;
+    Matrix<> am(N, N);
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = 0; j < N; j++)
+            am(i,j) = a[i*N+j] = (i == j ? N+1.0 : std::sin(1.0 + i + 2*j));
+    Vector<> b(N), xs(N), xd(N);
+    for (size_t i = 0; i < N; i++)
+        b(i) = std::cos(1.0 + i);
+
+    // best of 5 runs, against timer noise
+    using Clock = std::chrono::steady_clock;
+    SmallLU<N> small;
+    DenseLU<> dense;
+    double checksum = 0, tsmall = 1e99, tdense = 1e99;
+    for (int run = 0; run < 5; run++) {
+        auto start = Clock::now();
+        for (int r = 0; r < reps; r++) {
+            a[0] = N+1.0 + 1e-3*(r % 7);
+            small.factor(a);
+            xs = b;
+            small.solve(xs);
+            checksum += xs(0);
+        }
+        tsmall = std::min(tsmall, std::chrono::duration<double>(Clock::now()-start).count());
+
+        start = Clock::now();
+        for (int r = 0; r < reps; r++) {
+            am(0,0) = N+1.0 + 1e-3*(r % 7);
+            dense.factor(am);
+            xd = b;
+            dense.solve(xd);
+            checksum -= xd(0);
+        }
+        tdense = std::min(tdense, std::chrono::duration<double>(Clock::now()-start).count());
+    }
+
+    double err = 0;
+    for (size_t i = 0; i < N; i++)
+        err = std::max(err, std::fabs(xs(i) - xd(i)));
+
+    std::cout << "N = " << N << ": SmallLU " << 1e9*tsmall/reps << " ns, DenseLU "
+              << 1e9*tdense/reps << " ns, speed-up " << tdense/tsmall
+              << ", max difference " << err << " (checksum " << checksum << ")\n";
+    return err < 1e-12 && std::fabs(checksum) < 1e-6*reps;
+}
+
+int main()
+{
+    const int reps = 100000;
+    bool ok = Compare<2>(reps);
+    ok = Compare<4>(reps) && ok;
+    ok = Compare<8>(reps) && ok;
+    ok = Compare<12>(reps) && ok;
+
+    std::cout << (ok ? "SmallLU agrees with DenseLU\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -2,6 +2,8 @@
 #define NEWMARK_HPP
 
 #include <nonlinfunc.hpp>
+#include <simplify.hpp>
+#include <Newton.hpp>
 
 
 
@@ -30,15 +32,16 @@
     rhs->evaluate (xold->get(), aold->get());
 
     auto anew = std::make_shared<IdentityFunction>(a.size());
-    auto vnew = vold + dt*((1-gamma)*aold+gamma*anew);
-    auto xnew = xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew);    
+    auto vnew = Simplify(vold + dt*((1-gamma)*aold+gamma*anew));
+    auto xnew = Simplify(xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew));
 
-    auto equ = Compose(mass, anew) - Compose(rhs, xnew);
+    auto equ = Simplify(Compose(mass, anew) - Compose(rhs, xnew));
 
+    Newton newton;
     double t = 0;
     for (int i = 0; i < steps; i++)            
       {
-        NewtonSolver (equ, a);
+        newton.solve (equ, a);
         xnew -> evaluate (a, x);
         vnew -> evaluate (a, v);
 
@@ -76,18 +79,19 @@
     // rhs->evaluate (xold->get(), aold->get()); // solve with M ???
 
     auto anew = std::make_shared<IdentityFunction>(a.size());
-    auto vnew = vold + dt*((1-gamma)*aold+gamma*anew);
-    auto xnew = xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew);    
+    auto vnew = Simplify(vold + dt*((1-gamma)*aold+gamma*anew));
+    auto xnew = Simplify(xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew));
 
     // auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - Compose(rhs, (1-alphaf)*xnew+alphaf*xold);
-    auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - (1-alphaf)*Compose(rhs,xnew) - alphaf*Compose(rhs, xold);
+    auto equ = Simplify(Compose(mass, (1-alpham)*anew+alpham*aold) - (1-alphaf)*Compose(rhs,xnew) - alphaf*Compose(rhs, xold));
 
     double t = 0;
     a = ddx;
 
+    Newton newton;
     for (int i = 0; i < steps; i++)
       {
-        NewtonSolver (equ, a);
+        newton.solve (equ, a);
         xnew -> evaluate (a, x);
         vnew -> evaluate (a, v);
 
@@ -151,90 +151,156 @@ class MSS_Function : public NonlinearFunction
 {
   MassSpringSystem<D> &mss;
 
-public:
-  MSS_Function(MassSpringSystem<D> &s) : mss(s) {}
-
-  virtual size_t dimX() const override { return D * mss.masses().size(); }
-  virtual size_t dimF() const override { return D * mss.masses().size(); }
-
-  virtual void evaluate(VectorView<double> x, VectorView<double> f) const override
+  // call func(connectors, stiffness, length, r, dir) for every spring and
+  // penalty constraint with non-degenerate length r = |p2-p1|, dir = (p2-p1)/r
+  template <typename FUNC>
+  void forEachSpring(VectorView<double> x, FUNC func) const
   {
-    f = 0.0;
-
     auto xm = x.asMatrix(mss.masses().size(), D);
-    auto fm = f.asMatrix(mss.masses().size(), D);
 
-    // Gravity
-    for (size_t i = 0; i < mss.masses().size(); i++)
-      fm.row(i) = mss.masses()[i].mass * mss.getGravity();
-
-    // Springs
-    for (auto &s : mss.springs())
+    auto visit = [&](const std::array<Connector,2> & cons, double k, double L, double rmin)
     {
-      auto c1 = s.connectors[0];
-      auto c2 = s.connectors[1];
+      auto c1 = cons[0];
+      auto c2 = cons[1];
 
       Vec<D> p1 = (c1.type == Connector::FIX) ? mss.fixes()[c1.nr].pos : xm.row(c1.nr);
       Vec<D> p2 = (c2.type == Connector::FIX) ? mss.fixes()[c2.nr].pos : xm.row(c2.nr);
 
       Vec<D> d = p2 - p1;
       double r = norm(d);
-      if (r < 1e-12) continue;
-
-      double force = s.stiffness * (r - s.length);
+      if (r < rmin) return;
       Vec<D> dir = (1.0 / r) * d;
+      func(cons, k, L, r, dir);
+    };
 
-      if (c1.type == Connector::MASS) fm.row(c1.nr) += force * dir;
-      if (c2.type == Connector::MASS) fm.row(c2.nr) -= force * dir;
-    }
+    // Springs
+    for (auto &s : mss.springs())
+      visit(s.connectors, s.stiffness, s.length, 1e-12);
 
     // Penalty constraints
     double K = 2000;
     for (auto &c : mss.constraints())
-    {
-      auto c1 = c.connectors[0];
-      auto c2 = c.connectors[1];
-
-      Vec<D> p1 = (c1.type == Connector::FIX) ? mss.fixes()[c1.nr].pos : xm.row(c1.nr);
-      Vec<D> p2 = (c2.type == Connector::FIX) ? mss.fixes()[c2.nr].pos : xm.row(c2.nr);
-
-      Vec<D> d = p2 - p1;
-      double r = norm(d);
-      if (r < 1e-10) continue;
+      visit(c.connectors, K, c.length, 1e-10);
+  }
 
-      double F = K * (r - c.length);
-      Vec<D> dir = (1.0 / r) * d;
+  // gravity, before the spring forces are added
+  void initForces(VectorView<double> f) const
+  {
+    auto fm = f.asMatrix(mss.masses().size(), D);
+    for (size_t i = 0; i < mss.masses().size(); i++)
+      fm.row(i) = mss.masses()[i].mass * mss.getGravity();
+  }
 
-      if (c1.type == Connector::MASS) fm.row(c1.nr) += F * dir;
-      if (c2.type == Connector::MASS) fm.row(c2.nr) -= F * dir;
-    }
+  void addForce(VectorView<double> f, const std::array<Connector,2> & cons,
+                double k, double L, double r, const Vec<D> & dir) const
+  {
+    auto fm = f.asMatrix(mss.masses().size(), D);
+    double force = k * (r - L);
+    if (cons[0].type == Connector::MASS) fm.row(cons[0].nr) += force * dir;
+    if (cons[1].type == Connector::MASS) fm.row(cons[1].nr) -= force * dir;
+  }
 
-    // Convert force → acceleration
+  // Convert force → acceleration
+  void scaleByMass(VectorView<double> f) const
+  {
+    auto fm = f.asMatrix(mss.masses().size(), D);
     for (size_t i = 0; i < mss.masses().size(); i++)
       fm.row(i) *= 1.0 / mss.masses()[i].mass;
   }
 
-  // ---- NUMERICAL JACOBIAN (SAFE, WORKS, NO CRASHES) ----
+  // force on c1 is k (r-L) d/r with d = p2-p1; its derivative w.r.t. p2 is
+  // K = k ( (1-L/r) I + L/r dir dir^T ), w.r.t. p1 it is -K.
+  // MAT is a dense MatrixView or a SparseMatrix.
+  template <typename MAT>
+  void addStiffness(MAT & df, const std::array<Connector,2> & cons,
+                    double k, double L, double r, const Vec<D> & dir) const
+  {
+    double K[D][D];
+    for (int i = 0; i < D; i++)
+      for (int j = 0; j < D; j++)
+        K[i][j] = k * ((i == j ? 1 - L/r : 0.0) + L/r * dir(i)*dir(j));
+
+    auto addBlock = [&](Connector row, Connector col, double fac)
+    {
+      if (row.type != Connector::MASS || col.type != Connector::MASS) return;
+      fac /= mss.masses()[row.nr].mass;
+      for (int i = 0; i < D; i++)
+        for (int j = 0; j < D; j++)
+          df(row.nr*D+i, col.nr*D+j) += fac * K[i][j];
+    };
+    addBlock(cons[0], cons[0], -1);
+    addBlock(cons[0], cons[1], 1);
+    addBlock(cons[1], cons[0], 1);
+    addBlock(cons[1], cons[1], -1);
+  }
+
+public:
+  MSS_Function(MassSpringSystem<D> &s) : mss(s) {}
+
+  virtual size_t dimX() const override { return D * mss.masses().size(); }
+  virtual size_t dimF() const override { return D * mss.masses().size(); }
+  virtual bool isThreadSafe() const override { return true; }
+
+  virtual void evaluate(VectorView<double> x, VectorView<double> f) const override
+  {
+    initForces(f);
+    forEachSpring(x, [&](auto & cons, double k, double L, double r, const Vec<D> & dir)
+    {
+      addForce(f, cons, k, L, r, dir);
+    });
+    scaleByMass(f);
+  }
+
+  // ---- ANALYTIC JACOBIAN ----
   virtual void evaluateDeriv(VectorView<double> x, MatrixView<double> df) const override
   {
     df = 0.0;
+    forEachSpring(x, [&](auto & cons, double k, double L, double r, const Vec<D> & dir)
+    {
+      addStiffness(df, cons, k, L, r, dir);
+    });
+  }
 
-    double eps = 1e-8;
-    Vector<> xl(dimX()), xr(dimX());
-    Vector<> fl(dimF()), fr(dimF());
-
-    for (size_t i = 0; i < dimX(); i++)
+  // forces and Jacobian share one pass over the springs
+  virtual void evaluateWithDeriv(VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+  {
+    initForces(f);
+    df = 0.0;
+    forEachSpring(x, [&](auto & cons, double k, double L, double r, const Vec<D> & dir)
     {
-      xl = x;
-      xr = x;
-      xl(i) -= eps;
-      xr(i) += eps;
+      addForce(f, cons, k, L, r, dir);
+      addStiffness(df, cons, k, L, r, dir);
+    });
+    scaleByMass(f);
+  }
 
-      evaluate(xl, fl);
-      evaluate(xr, fr);
+  // ---- SPARSE JACOBIAN: one DxD block per mass pair coupled by a spring ----
+  virtual bool hasDerivPattern() const override { return true; }
+  virtual void getDerivPattern(SparsityPattern & pattern) const override
+  {
+    for (size_t i = 0; i < mss.masses().size(); i++)
+      pattern.addBlock(i*D, (i+1)*D, i*D, (i+1)*D);
 
-      df.col(i) = (1.0 / (2 * eps)) * (fr - fl);
-    }
+    auto couple = [&](const std::array<Connector,2> & cons)
+    {
+      if (cons[0].type == Connector::MASS && cons[1].type == Connector::MASS)
+      {
+        size_t n1 = cons[0].nr, n2 = cons[1].nr;
+        pattern.addBlock(n1*D, (n1+1)*D, n2*D, (n2+1)*D);
+        pattern.addBlock(n2*D, (n2+1)*D, n1*D, (n1+1)*D);
+      }
+    };
+    for (auto &s : mss.springs()) couple(s.connectors);
+    for (auto &c : mss.constraints()) couple(c.connectors);
+  }
+
+  virtual void evaluateDerivSparse(VectorView<double> x, SparseMatrix & df) const override
+  {
+    df = 0.0;
+    forEachSpring(x, [&](auto & cons, double k, double L, double r, const Vec<D> & dir)
+    {
+      addStiffness(df, cons, k, L, r, dir);
+    });
   }
 };
 
@@ -1,7 +1,11 @@
 #ifndef Newton_h
 #define Newton_h
 
+#include <chrono>
+#include <functional>
+
 #include "nonlinfunc.hpp"
+#include "linearsolver.hpp"
 #include <inverse.hpp>
 #include <lapack_interface.hpp>
 
@@ -13,22 +17,448 @@ namespace ASC_ode
   {
     Vector<double> res(func->dimF());
     Matrix<double> fprime(func->dimF(), func->dimX());
+    DenseLU<> lu;
 
     for (int i = 0; i < maxsteps; i++)
       {
-        func->evaluate(x, res);
+        func->evaluateWithDeriv(x, res, fprime);
         double err= norm(res);
         if (err < tol) return;
 
-        func->evaluateDeriv(x, fprime);
+        try { lu.factor(fprime); }
+        catch (std::domain_error &) { throw std::domain_error("Newton: singular Jacobian"); }
+        lu.solve(res);
+        x -= res;
+ 
+        if (callback)
+          callback(i, err, x);
+      }
+
+    throw std::domain_error("Newton did not converge");
+  }
 
-        calcInverse(fprime);
-        x -= fprime*res;
 
-        // LapackLU LU(fprime);
-        // LU.solve(res);
-        // x -= res;
- 
+  // what the last Newton::solve call did, times in seconds
+  struct NewtonStats
+  {
+    int iterations = 0;       // Newton updates, including a restart
+    int factorizations = 0;   // also the failed ones
+    int backtracks = 0;       // step halvings in the line search
+    double residual = 0;      // norm of the final residual
+    double rate = 0;          // last residual contraction factor
+    double time_eval = 0;     // evaluate
+    double time_jac = 0;      // value and Jacobian assembly
+    double time_solve = 0;    // factorization and solves
+  };
+
+  enum class NewtonStatus
+  {
+    Converged,
+    MaxSteps,          // no convergence within maxsteps iterations
+    NoDescent,         // the line search found no sufficient decrease
+    NotFinite,         // the residual became inf or nan
+    Singular           // the Jacobian could not be factored
+  };
+
+
+  /*
+    Simplified Newton method keeping the LU factorization of the Jacobian
+    across iterations and across solve calls, e.g. the time steps of an
+    implicit method. The Jacobian is refreshed only if
+
+      - the residual contracts by less than the factor theta per iteration,
+      - the factorization has been used for maxage iterations, or
+      - the iteration failed with an old factorization; then the solve is
+        restarted from the initial guess with a fresh Jacobian.
+
+    theta = 0 and maxage = 1 give the full Newton method. With broyden > 0
+    the factorization B0 is corrected by rank-one Broyden updates from the
+    steps of the current solve (Kelley's limited-memory brsol, at most
+    broyden stored steps), which keeps superlinear convergence while the
+    Jacobian is formed rarely.
+
+    Every update is globalized by an Armijo backtracking line search on
+    |f|: the step is halved (at most maxbacktracks times) until the residual
+    decreases by the factor 1 - 1e-4 lambda. trySolve reports failure,
+    including a singular Jacobian, as a NewtonStatus and resets x, so a
+    time stepper can retry with a smaller step.
+
+    For an affine function (isAffine) a single solve is exact up to
+    rounding: the factorization is kept as long as jacobianVersion does not
+    change, e.g. until the time step tau is changed, and a solve costs one
+    back-substitution and two evaluations, the second one checking the
+    residual. If that is not below tol, the Newton iteration takes over.
+  */
+  class Newton
+  {
+  public:
+    double tol = 1e-10;
+    int maxsteps = 10;
+    double theta = 0.5;
+    int maxage = 50;
+    int broyden = 0;
+    bool linesearch = true;
+    int maxbacktracks = 10;
+
+  private:
+    std::shared_ptr<LinearSolver> m_solver;
+    bool m_autosolver = true;
+    const NonlinearFunction * m_func = nullptr;   // function of the last solve
+    size_t m_jacversion = 0;
+    bool m_valid = false;     // m_solver holds a usable factorization
+    int m_age = 0;
+    std::vector<double> m_res, m_dx, m_x0;
+    std::vector<double> m_steps, m_stepnorm2;     // Broyden steps of this solve
+    NewtonStats m_stats;
+
+    using Clock = std::chrono::steady_clock;
+    static double Seconds (Clock::time_point start)
+    {
+      return std::chrono::duration<double>(Clock::now()-start).count();
+    }
+
+    // Turn d = B0^{-1} f into the Broyden correction, using the k steps
+    // s_0 ... s_{k-1} stored since the last factorization, and store the new
+    // step s_k = -d. Restarts from B0 when the storage is full.
+    void broydenCorrection (VectorView<double> d, int & k)
+    {
+      auto steps = ScratchMatrix(m_steps, broyden, d.size());
+      m_stepnorm2.resize(broyden);
+      if (k == broyden) k = 0;
+
+      if (k > 0)
+        {
+          for (int j = 0; j+1 < k; j++)
+            d += (dot(steps.row(j), d) / m_stepnorm2[j]) * steps.row(j+1);
+          double denom = 1 + dot(steps.row(k-1), d) / m_stepnorm2[k-1];
+          if (denom == 0)
+            {
+              // singular update: use d as it is, refactor at the next iterate
+              k = 0;
+              m_valid = false;
+            }
+          else
+            d *= 1.0 / denom;
+        }
+
+      steps.row(k) = -1.0 * d;
+      m_stepnorm2[k] = dot(d, d);
+      k++;
+    }
+
+    // factor the assembled Jacobian, false if it is singular; a failed
+    // attempt is counted and timed as well
+    bool factor ()
+    {
+      auto start = Clock::now();
+      m_stats.factorizations++;
+      m_valid = true;
+      try { m_solver->factor(); }
+      catch (std::domain_error &)
+        {
+          m_valid = false;
+        }
+      m_stats.time_solve += Seconds(start);
+      return m_valid;
+    }
+
+    double evaluateNorm (const NonlinearFunction & func, VectorView<double> x, VectorView<double> res)
+    {
+      auto start = Clock::now();
+      func.evaluate(x, res);
+      m_stats.time_eval += Seconds(start);
+      return norm(res);
+    }
+
+    NewtonStatus iterate (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                          std::function<void(int,double,VectorView<double>)> callback)
+    {
+      auto res = ScratchVector(m_res, func->dimF());
+      auto dx = ScratchVector(m_dx, func->dimX());
+      bool haveres = false;     // res = f(x) from the line search
+      int nsteps = 0;
+
+      for (int i = 0; i < maxsteps; i++)
+        {
+          bool fresh = !m_valid || m_age >= maxage;
+          if (fresh)
+            {
+              auto start = Clock::now();
+              m_solver->assemble(*func, x, res);
+              m_stats.time_jac += Seconds(start);
+
+              if (!factor()) return NewtonStatus::Singular;
+              m_age = 0;
+              nsteps = 0;
+            }
+          else if (!haveres)
+            evaluateNorm(*func, x, res);
+
+          double err = norm(res);
+          m_stats.residual = err;
+          if (err < tol) return NewtonStatus::Converged;
+          if (!std::isfinite(err)) return NewtonStatus::NotFinite;
+
+          auto start = Clock::now();
+          dx = res;
+          m_solver->solve(dx);
+          if (broyden > 0)
+            broydenCorrection(dx, nsteps);
+          m_stats.time_solve += Seconds(start);
+
+          // Armijo backtracking, x = x_old - lambda dx
+          double lambda = 1;
+          x -= dx;
+          double errnew = evaluateNorm(*func, x, res);
+          int backtracks = 0;
+          while (linesearch && !(errnew <= (1-1e-4*lambda) * err) && backtracks < maxbacktracks)
+            {
+              lambda *= 0.5;
+              x += lambda * dx;
+              errnew = evaluateNorm(*func, x, res);
+              backtracks++;
+            }
+          m_stats.backtracks += backtracks;
+          m_stats.iterations++;
+          m_age++;
+          haveres = true;
+
+          if (linesearch && !(errnew <= (1-1e-4*lambda) * err))
+            {
+              // no descent along dx: undo the step, refactor if the
+              // Jacobian was old, give up otherwise
+              x += lambda * dx;
+              if (fresh) return NewtonStatus::NoDescent;
+              m_valid = false;
+              haveres = false;
+              continue;
+            }
+
+          m_stats.rate = errnew / err;
+          if (backtracks > 0) nsteps = 0;   // Broyden steps assume full updates
+          // slow contraction: refactor at the next iterate
+          if (!fresh && errnew > theta * err)
+            m_valid = false;
+
+          if (callback)
+            callback(i, err, x);
+        }
+
+      m_stats.residual = norm(res);
+      if (haveres && m_stats.residual < tol) return NewtonStatus::Converged;
+      return std::isfinite(m_stats.residual) ? NewtonStatus::MaxSteps : NewtonStatus::NotFinite;
+    }
+
+    // f(x) = A x + b: one solve, with A factored only when it changes
+    NewtonStatus solveAffine (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                              std::function<void(int,double,VectorView<double>)> callback)
+    {
+      auto res = ScratchVector(m_res, func->dimF());
+      size_t jacversion = func->jacobianVersion();
+      if (!m_valid || jacversion != m_jacversion)
+        {
+          auto start = Clock::now();
+          m_solver->assemble(*func, x, res);
+          m_stats.time_jac += Seconds(start);
+
+          if (!factor()) return NewtonStatus::Singular;
+          m_jacversion = jacversion;
+        }
+      else
+        evaluateNorm(*func, x, res);
+
+      double err = norm(res);
+      m_stats.residual = err;
+      if (err < tol) return NewtonStatus::Converged;
+      if (!std::isfinite(err)) return NewtonStatus::NotFinite;
+
+      auto start = Clock::now();
+      m_solver->solve(res);
+      m_stats.time_solve += Seconds(start);
+      x -= res;
+      m_stats.iterations++;
+      if (callback)
+        callback(0, err, x);
+
+      m_stats.residual = evaluateNorm(*func, x, res);
+      if (m_stats.residual < tol) return NewtonStatus::Converged;
+      if (!std::isfinite(m_stats.residual)) return NewtonStatus::NotFinite;
+      // ill-conditioned A, or the function is not affine after all
+      return iterate(func, x, callback);
+    }
+
+  public:
+    Newton () = default;
+    Newton (double atol, int amaxsteps = 10)
+      : tol(atol), maxsteps(amaxsteps) { }
+
+    // drop the stored factorization, e.g. after the system has changed
+    void reset() { m_valid = false; }
+
+    // e.g. a SparseLUSolver for large sparse Jacobians. Without a solver
+    // set, tiny systems get a SmallLUSolver, larger ones a banded or a
+    // dense LU chosen from the Jacobian's bandwidth.
+    void setLinearSolver (std::shared_ptr<LinearSolver> solver)
+    {
+      m_solver = solver;
+      m_autosolver = false;
+      m_valid = false;
+    }
+
+    const NewtonStats & stats() const { return m_stats; }
+
+    // solve func(x) = 0 with x as initial guess; if not converged, x is
+    // reset to the initial guess
+    NewtonStatus trySolve (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                           std::function<void(int,double,VectorView<double>)> callback = nullptr)
+    {
+      m_stats = NewtonStats();
+      if (func.get() != m_func)
+        {
+          if (m_autosolver)
+            m_solver = ChooseLinearSolver(*func);
+          m_func = func.get();
+          m_valid = false;
+        }
+      if (m_solver->size() != func->dimX())
+        m_valid = false;
+
+      bool affine = func->isAffine();
+      bool reused = m_valid;
+      auto x0 = ScratchVector(m_x0, func->dimX());
+      x0 = x;
+
+      auto status = affine ? solveAffine(func, x, callback) : iterate(func, x, callback);
+      if (status != NewtonStatus::Converged && reused)
+        {
+          x = x0;
+          m_valid = false;
+          status = affine ? solveAffine(func, x, callback) : iterate(func, x, callback);
+        }
+
+      if (status != NewtonStatus::Converged)
+        {
+          x = x0;
+          m_valid = false;
+        }
+      return status;
+    }
+
+    void solve (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                std::function<void(int,double,VectorView<double>)> callback = nullptr)
+    {
+      if (trySolve(func, x, callback) != NewtonStatus::Converged)
+        throw std::domain_error("Newton did not converge");
+    }
+  };
+
+
+
+  // Restarted GMRES for A x = b, with A given by its action y = A x.
+  // x holds the initial guess. Returns the number of iterations used.
+  inline int GMRES (std::function<void(VectorView<double>,VectorView<double>)> apply,
+                    VectorView<double> b, VectorView<double> x,
+                    double tol, int restart = 30, int maxit = 300)
+  {
+    size_t n = b.size();
+    restart = std::min<int>(restart, n);
+
+    Matrix<double> V(restart+1, n);   // Krylov basis, one vector per row
+    Matrix<double> H(restart+1, restart);
+    Vector<> cs(restart), sn(restart), g(restart+1), y(restart);
+    Vector<> r(n);
+
+    int it = 0;
+    while (it < maxit)
+      {
+        apply(x, r);
+        r = b - r;
+        double beta = norm(r);
+        if (beta <= tol) return it;
+
+        V.row(0) = (1.0/beta) * r;
+        g = 0.0;
+        g(0) = beta;
+
+        int k = 0;
+        for ( ; k < restart && it < maxit; k++, it++)
+          {
+            // Arnoldi with modified Gram-Schmidt
+            auto w = V.row(k+1);
+            apply(V.row(k), w);
+            for (int i = 0; i <= k; i++)
+              {
+                H(i,k) = dot(w, V.row(i));
+                w -= H(i,k) * V.row(i);
+              }
+            H(k+1,k) = norm(w);
+            if (H(k+1,k) != 0)
+              w *= 1.0 / H(k+1,k);
+
+            // Givens rotations keep H upper triangular
+            for (int i = 0; i < k; i++)
+              {
+                double tmp = cs(i)*H(i,k) + sn(i)*H(i+1,k);
+                H(i+1,k) = -sn(i)*H(i,k) + cs(i)*H(i+1,k);
+                H(i,k) = tmp;
+              }
+            double rho = std::hypot(H(k,k), H(k+1,k));
+            cs(k) = H(k,k) / rho;
+            sn(k) = H(k+1,k) / rho;
+            H(k,k) = rho;
+            H(k+1,k) = 0;
+            g(k+1) = -sn(k)*g(k);
+            g(k) = cs(k)*g(k);
+
+            if (std::abs(g(k+1)) <= tol)
+              {
+                k++; it++;
+                break;
+              }
+          }
+
+        // x += V^T y,  H y = g
+        for (int i = k-1; i >= 0; i--)
+          {
+            double sum = g(i);
+            for (int j = i+1; j < k; j++)
+              sum -= H(i,j) * y(j);
+            y(i) = sum / H(i,i);
+          }
+        for (int i = 0; i < k; i++)
+          x += y(i) * V.row(i);
+
+        if (std::abs(g(k)) <= tol) return it;
+      }
+    return it;
+  }
+
+
+  // Inexact Newton: the Newton update is computed with GMRES from
+  // Jacobian-vector products only, the Jacobian is never formed
+  inline void NewtonKrylovSolver (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                                  double tol = 1e-10, int maxsteps = 10,
+                                  std::function<void(int,double,VectorView<double>)> callback = nullptr)
+  {
+    Vector<double> res(func->dimF());
+    Vector<double> dx(func->dimX());
+    auto jacobian = [&](VectorView<double> v, VectorView<double> jv)
+    {
+      func->evaluateJv(x, v, jv);
+    };
+
+    for (int i = 0; i < maxsteps; i++)
+      {
+        func->evaluate(x, res);
+        double err = norm(res);
+        if (err < tol) return;
+
+        // forcing term: tighten the linear tolerance as Newton converges
+        double eta = std::min(0.1, std::sqrt(err));
+        dx = 0.0;
+        GMRES(jacobian, res, dx, std::max(eta*err, 0.1*tol));
+        x -= dx;
+
         if (callback)
           callback(i, err, x);
       }
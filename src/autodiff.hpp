@@ -131,6 +131,18 @@ AutoDiff<N, T> operator-(const AutoDiff<N, T> &a, const AutoDiff<N, T> &b)
     return r;
 }
 
+template <size_t N, typename T = double>
+AutoDiff<N, T> operator-(T a, const AutoDiff<N, T> &b)
+{
+    return AutoDiff<N, T>(a) - b;
+}
+
+template <size_t N, typename T = double>
+AutoDiff<N, T> operator-(const AutoDiff<N, T> &a, T b)
+{
+    return a - AutoDiff<N, T>(b);
+}
+
 
 // =====================================================
 // Multiplication (3 overloads)
@@ -201,6 +213,7 @@ using std::cos;
 using std::exp;
 using std::log;
 using std::sin;
+using std::sqrt;
 
 template <size_t N, typename T = double>
 AutoDiff<N, T> sin(const AutoDiff<N, T> &a)
@@ -238,6 +251,15 @@ AutoDiff<N, T> log(const AutoDiff<N, T> &a)
     return r;
 }
 
+template <size_t N, typename T = double>
+AutoDiff<N, T> sqrt(const AutoDiff<N, T> &a)
+{
+    AutoDiff<N, T> r(sqrt(a.value()));
+    for (size_t i = 0; i < N; i++)
+        r.deriv()[i] = a.deriv()[i] / (2 * r.value());
+    return r;
+}
+
 template <size_t N, typename T = double>
 AutoDiff<N, T> pow(const AutoDiff<N, T> &a, double p)
 {
@@ -0,0 +1,119 @@
+#ifndef AUTODIFFFUNC_HPP
+#define AUTODIFFFUNC_HPP
+
+#include <algorithm>
+
+#include "nonlinfunc.hpp"
+#include "autodiff.hpp"
+
+namespace ASC_ode
+{
+
+  /*
+    NonlinearFunction from a generic callable  func(x, f)  taking
+    VectorView<T> for T = double and T = AutoDiff<N>, e.g.
+
+      auto pendulum = MakeAutoDiffFunction<2>(2, 2, [](auto x, auto f)
+      {
+        f(0) = x(1);
+        f(1) = -sin(x(0));
+      });
+
+    evaluate runs func with doubles. The Jacobian is computed exactly by
+    running func with AutoDiff<N>, seeding N unit directions at once: for
+    dimX > N the columns are computed in blocks of N, so the cost is
+    ceil(dimX/N) AutoDiff evaluations. evaluateJv seeds the single
+    direction v.
+  */
+  template <size_t N, typename FUNC>
+  class AutoDiffFunction : public NonlinearFunction
+  {
+    size_t m_dimx, m_dimf;
+    FUNC m_func;
+    mutable std::vector<AutoDiff<N>> m_adx, m_adf;
+    mutable std::vector<AutoDiff<1>> m_dirx, m_dirf;
+
+    // evaluate func with derivatives w.r.t. x(first) ... x(first+N-1),
+    // returns the number of columns in this block
+    size_t evaluateBlock (VectorView<double> x, size_t first) const
+    {
+      m_adx.resize(m_dimx);
+      m_adf.resize(m_dimf);
+      for (size_t i = 0; i < m_dimx; i++)
+        m_adx[i] = AutoDiff<N>(x(i));
+      size_t num = std::min(N, m_dimx-first);
+      for (size_t k = 0; k < num; k++)
+        m_adx[first+k].deriv()[k] = 1;
+
+      m_func(VectorView<AutoDiff<N>>(m_dimx, m_adx.data()),
+             VectorView<AutoDiff<N>>(m_dimf, m_adf.data()));
+      return num;
+    }
+
+    void copyBlock (MatrixView<double> df, size_t first, size_t num) const
+    {
+      for (size_t i = 0; i < m_dimf; i++)
+        for (size_t k = 0; k < num; k++)
+          df(i, first+k) = m_adf[i].deriv()[k];
+    }
+
+  public:
+    AutoDiffFunction (size_t dimx, size_t dimf, FUNC func)
+      : m_dimx(dimx), m_dimf(dimf), m_func(func) { }
+
+    size_t dimX() const override { return m_dimx; }
+    size_t dimF() const override { return m_dimf; }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      m_func(x, f);
+    }
+
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      for (size_t first = 0; first < m_dimx; first += N)
+        copyBlock(df, first, evaluateBlock(x, first));
+    }
+
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      if (m_dimx == 0)
+        {
+          evaluate(x, f);
+          return;
+        }
+      for (size_t first = 0; first < m_dimx; first += N)
+        {
+          copyBlock(df, first, evaluateBlock(x, first));
+          if (first == 0)
+            for (size_t i = 0; i < m_dimf; i++)
+              f(i) = m_adf[i].value();
+        }
+    }
+
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      m_dirx.resize(m_dimx);
+      m_dirf.resize(m_dimf);
+      for (size_t i = 0; i < m_dimx; i++)
+        {
+          m_dirx[i] = AutoDiff<1>(x(i));
+          m_dirx[i].deriv()[0] = v(i);
+        }
+      m_func(VectorView<AutoDiff<1>>(m_dimx, m_dirx.data()),
+             VectorView<AutoDiff<1>>(m_dimf, m_dirf.data()));
+      for (size_t i = 0; i < m_dimf; i++)
+        jv(i) = m_dirf[i].deriv()[0];
+    }
+  };
+
+
+  template <size_t N, typename FUNC>
+  auto MakeAutoDiffFunction (size_t dimx, size_t dimf, FUNC func)
+  {
+    return std::make_shared<AutoDiffFunction<N,FUNC>> (dimx, dimf, func);
+  }
+
+}
+
+#endif
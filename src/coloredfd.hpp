@@ -0,0 +1,186 @@
+#ifndef COLOREDFD_HPP
+#define COLOREDFD_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "nonlinfunc.hpp"
+#include "threadpool.hpp"
+
+namespace ASC_ode
+{
+
+  // Sparsity pattern found by perturbing every coordinate of x once.
+  // Entries which happen to have a vanishing derivative at x are missed,
+  // so x should be a generic point, not a symmetric initial state.
+  inline SparsityPattern ProbeDerivPattern (const NonlinearFunction & func, VectorView<double> x)
+  {
+    size_t dimx = func.dimX(), dimf = func.dimF();
+    Vector<> xp(dimx), f0(dimf), fp(dimf);
+    func.evaluate(x, f0);
+
+    SparsityPattern pattern(dimf, dimx);
+    for (size_t j = 0; j < dimx; j++)
+      {
+        xp = x;
+        xp(j) += 1e-6 * (1 + std::fabs(x(j)));
+        func.evaluate(xp, fp);
+        for (size_t i = 0; i < dimf; i++)
+          if (fp(i) != f0(i))
+            pattern.add(i, j);
+      }
+    pattern.finalize();
+    return pattern;
+  }
+
+
+  /*
+    Finite-difference Jacobian of func exploiting a known sparsity pattern.
+    Columns without a common nonzero row get the same colour (greedy
+    Curtis-Powell-Reid colouring) and are perturbed together, so the
+    Jacobian costs one evaluation per colour plus one at x, about the
+    maximal number of nonzeros per row instead of dimX evaluations.
+    The pattern is given, e.g. func->derivPattern() for a function with
+    hasDerivPattern(), or probed at x0 by ProbeDerivPattern. If func is
+    thread safe and not tiny, the colours are evaluated in parallel, with
+    scratch vectors per thread.
+  */
+  class ColoredFDFunction : public NonlinearFunction
+  {
+    std::shared_ptr<NonlinearFunction> m_func;
+    SparsityPattern m_pattern;
+    std::vector<std::vector<size_t>> m_colrows;   // nonzero rows of every column
+    std::vector<std::vector<size_t>> m_colors;    // columns of every colour
+    mutable std::vector<double> m_f0;
+    mutable std::vector<std::vector<double>> m_xp, m_fp;   // per thread
+
+    void colorColumns()
+    {
+      size_t dimx = m_pattern.width();
+      m_colrows.assign(dimx, {});
+      for (size_t i = 0; i < m_pattern.height(); i++)
+        for (size_t j : m_pattern.row(i))
+          m_colrows[j].push_back(i);
+
+      // smallest colour not used by an earlier column sharing a row
+      std::vector<size_t> color(dimx);
+      std::vector<size_t> forbidden;   // column which last blocked the colour
+      for (size_t j = 0; j < dimx; j++)
+        {
+          for (size_t i : m_colrows[j])
+            for (size_t k : m_pattern.row(i))
+              if (k < j) forbidden[color[k]] = j;
+
+          size_t c = 0;
+          while (c < forbidden.size() && forbidden[c] == j) c++;
+          if (c == forbidden.size())
+            {
+              forbidden.push_back(dimx);
+              m_colors.emplace_back();
+            }
+          color[j] = c;
+          m_colors[c].push_back(j);
+        }
+    }
+
+    // difference quotients, given f0 = f(x); set(i,j,val) stores an entry
+    template <typename SET>
+    void differences (VectorView<double> x, VectorView<double> f0, SET set) const
+    {
+      double sqeps = std::sqrt(std::numeric_limits<double>::epsilon());
+      auto color = [&](size_t c, size_t thread)
+      {
+        auto xp = ScratchVector(m_xp[thread], dimX());
+        auto fp = ScratchVector(m_fp[thread], dimF());
+        xp = x;
+        for (size_t j : m_colors[c])
+          xp(j) += sqeps * (1 + std::fabs(x(j)));
+        m_func->evaluate(xp, fp);
+        for (size_t j : m_colors[c])
+          {
+            double h = xp(j) - x(j);
+            for (size_t i : m_colrows[j])
+              set(i, j, (fp(i) - f0(i)) / h);
+          }
+      };
+
+      if (m_func->isThreadSafe() && dimX() >= ParallelMinDim)
+        {
+          auto & pool = DefaultThreadPool();
+          m_xp.resize(pool.numThreads());
+          m_fp.resize(pool.numThreads());
+          pool.parallelFor(m_colors.size(), color);
+        }
+      else
+        {
+          m_xp.resize(1);
+          m_fp.resize(1);
+          for (size_t c = 0; c < m_colors.size(); c++)
+            color(c, 0);
+        }
+    }
+
+  public:
+    ColoredFDFunction (std::shared_ptr<NonlinearFunction> func, VectorView<double> x0)
+      : ColoredFDFunction (func, ProbeDerivPattern(*func, x0)) { }
+
+    ColoredFDFunction (std::shared_ptr<NonlinearFunction> func, SparsityPattern pattern)
+      : m_func(func), m_pattern(pattern)
+    {
+      m_pattern.finalize();
+      colorColumns();
+    }
+
+    size_t dimX() const override { return m_func->dimX(); }
+    size_t dimF() const override { return m_func->dimF(); }
+    size_t numColors() const { return m_colors.size(); }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      m_func->evaluate(x, f);
+    }
+
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      auto f0 = ScratchVector(m_f0, dimF());
+      m_func->evaluate(x, f0);
+      df = 0.0;
+      differences(x, f0, [&](size_t i, size_t j, double val) { df(i,j) = val; });
+    }
+
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      m_func->evaluate(x, f);
+      df = 0.0;
+      differences(x, f, [&](size_t i, size_t j, double val) { df(i,j) = val; });
+    }
+
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      pattern.add(m_pattern);
+    }
+
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      auto f0 = ScratchVector(m_f0, dimF());
+      m_func->evaluate(x, f0);
+      df = 0.0;
+      differences(x, f0, [&](size_t i, size_t j, double val) { df(i,j) = val; });
+    }
+
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      m_func->evaluateJv(x, v, jv);
+    }
+
+    size_t version() const override { return m_func->version(); }
+    bool isConstant() const override { return m_func->isConstant(); }
+    bool isAffine() const override { return m_func->isAffine(); }
+    size_t jacobianVersion() const override { return m_func->jacobianVersion(); }
+  };
+
+}
+
+#endif
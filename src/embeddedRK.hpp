@@ -0,0 +1,375 @@
+#ifndef EMBEDDEDRK_HPP
+#define EMBEDDEDRK_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+#include <vector.hpp>
+#include <matrix.hpp>
+
+#include "timestepper.hpp"
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+
+  /*
+    Explicit Runge-Kutta pair: the stages k_i = f(y + tau sum_j a_ij k_j)
+    give the new solution y + tau sum_i b_i k_i, and y + tau sum_i bhat_i k_i
+    of lower order. Their difference estimates the local error. If the
+    last stage is evaluated at the new solution (first same as last, FSAL),
+    it is reused as the first stage of the next step after accept().
+
+    Dense output is built from the stages of the last accepted step: a
+    continuous extension y0 + tau sum_i b_i(theta) k_i if the pair has one,
+    else Hermite interpolation with f(y0) = k_0 and, for FSAL pairs,
+    f(y1) = k_{s-1}.
+  */
+  class EmbeddedRungeKutta : public ExplicitRungeKutta
+  {
+    int m_order;                  // order of bhat
+    std::vector<double> m_e;      // b - bhat
+    bool m_fsal;
+    bool m_firstvalid = false;    // stage 0 holds f(y)
+    bool m_fsalcopy = false;      // stage s-1 goes to stage 0 at the next step
+    double m_steptau = 0;
+    size_t m_densedeg = 0;        // degree of the continuous extension
+    std::vector<double> m_bpoly;  // b_i(theta) = sum_p bpoly(i,p) theta^(p+1)
+    std::vector<double> m_btheta;
+
+    double weight (double yl, double ynewl, double rtol, double atol) const
+    {
+      return 1.0 / (atol + rtol * std::max(std::fabs(yl), std::fabs(ynewl)));
+    }
+
+  public:
+    EmbeddedRungeKutta (std::shared_ptr<NonlinearFunction> rhs,
+                        const Matrix<> & a, const Vector<> & b, const Vector<> & bhat,
+                        const Vector<> & c, int order)
+      : ExplicitRungeKutta(rhs, a, b, c), m_order(order), m_e(m_stages)
+    {
+      for (size_t i = 0; i < m_stages; i++)
+        m_e[i] = b(i) - bhat(i);
+      m_fsal = m_c[m_stages-1] == 1;
+      for (size_t j = 0; j < m_stages; j++)
+        if (m_a[(m_stages-1)*m_stages+j] != m_b[j])
+          m_fsal = false;
+    }
+
+    // order of the embedded solution, the local error behaves like tau^(order+1)
+    int errorOrder() const { return m_order; }
+
+    // continuous extension of degree bpoly.cols(), bpoly(i,p) is the
+    // coefficient of theta^(p+1) in the weight b_i(theta) with b_i(1) = b_i
+    void setContinuousExtension (const Matrix<> & bpoly)
+    {
+      m_densedeg = bpoly.cols();
+      m_bpoly.resize(m_stages*m_densedeg);
+      m_btheta.resize(m_stages);
+      for (size_t i = 0; i < m_stages; i++)
+        for (size_t p = 0; p < m_densedeg; p++)
+          m_bpoly[i*m_densedeg+p] = bpoly(i,p);
+    }
+
+    // the next step does not start from the last accepted solution
+    void reset() { m_firstvalid = m_fsalcopy = false; }
+
+    // fixed step with the higher order solution
+    void doStep (double tau, VectorView<double> y) override
+    {
+      m_firstvalid = m_fsalcopy = false;
+      ExplicitRungeKutta::doStep(tau, y);
+    }
+
+    // y at t + theta tau for the last accepted step, valid until the next
+    // call of step() or doStep()
+    void denseOutput (double theta, VectorView<double> y) override
+    {
+      if (!m_denseoutput || m_densetau == 0)
+        throw std::logic_error("denseOutput: enableDenseOutput and doStep first");
+      if (m_densedeg == 0)
+        {
+          if (!m_densef)
+            {
+              ScratchVector(m_dense[1], m_n) = stage(0);
+              auto f1 = ScratchVector(m_dense[3], m_n);
+              if (m_fsal)
+                f1 = stage(m_stages-1);
+              else
+                m_rhs->evaluate(ScratchVector(m_dense[2], m_n), f1);
+              m_densef = true;
+            }
+          TimeStepper::denseOutput(theta, y);
+          return;
+        }
+
+      for (size_t i = 0; i < m_stages; i++)
+        {
+          double w = 0, pow = theta;
+          for (size_t p = 0; p < m_densedeg; p++, pow *= theta)
+            w += m_bpoly[i*m_densedeg+p] * pow;
+          m_btheta[i] = w;
+        }
+      combine(y, ScratchVector(m_dense[0], m_n), m_densetau, m_btheta.data(), m_stages);
+    }
+
+    // ynew = solution after the step from y, returns the root mean square
+    // of the local error estimate scaled by atol + rtol |y|; the step is
+    // acceptable if this is at most 1. y is not changed.
+    double step (double tau, VectorView<double> y, VectorView<double> ynew,
+                 double rtol, double atol)
+    {
+      beginStep(y);
+      m_steptau = tau;
+      if (m_fsalcopy)
+        {
+          stage(0) = stage(m_stages-1);
+          m_fsalcopy = false;
+        }
+      computeStages(tau, y, m_firstvalid ? 1 : 0);
+      m_firstvalid = true;
+      double err2 = 0;
+      for (size_t l = 0; l < m_n; l++)
+        {
+          double sum = 0, err = 0;
+          for (size_t i = 0; i < m_stages; i++)
+            {
+              sum += m_b[i] * m_k[i*m_n+l];
+              err += m_e[i] * m_k[i*m_n+l];
+            }
+          ynew(l) = y(l) + tau * sum;
+          double scaled = tau * err * weight(y(l), ynew(l), rtol, atol);
+          err2 += scaled * scaled;
+        }
+      return m_n ? std::sqrt(err2 / m_n) : 0.0;
+    }
+
+    // the last step() was accepted, the next one starts from its ynew.
+    // The FSAL stage is moved by the next step(), the stages stay
+    // available for dense output until then.
+    void accept(VectorView<double> ynew)
+    {
+      endStep(m_steptau, ynew);
+      m_fsalcopy = m_firstvalid = m_fsal;
+    }
+
+    // first step size guess from the scaled sizes of y and f(y)
+    double initialStep (VectorView<double> y, double rtol, double atol)
+    {
+      m_rhs->evaluate(y, stage(0));
+      m_firstvalid = true;
+      m_fsalcopy = false;
+      double d0 = 0, d1 = 0;
+      for (size_t l = 0; l < m_n; l++)
+        {
+          double w = weight(y(l), y(l), rtol, atol);
+          d0 += y(l)*y(l) * w*w;
+          d1 += m_k[l]*m_k[l] * w*w;
+        }
+      if (d0 < 1e-10 || d1 < 1e-10) return 1e-6;
+      return 0.01 * std::sqrt(d0 / d1);
+    }
+  };
+
+
+  // Bogacki-Shampine 3(2), FSAL with 3 new stages per step
+  inline std::shared_ptr<EmbeddedRungeKutta> BogackiShampine32 (std::shared_ptr<NonlinearFunction> rhs)
+  {
+    Matrix<> a(4, 4);
+    a = 0.0;
+    a(1,0) = 1.0/2;
+    a(2,1) = 3.0/4;
+    a(3,0) = 2.0/9;   a(3,1) = 1.0/3;   a(3,2) = 4.0/9;
+    Vector<> b { 2.0/9, 1.0/3, 4.0/9, 0 };
+    Vector<> bhat { 7.0/24, 1.0/4, 1.0/3, 1.0/8 };
+    Vector<> c { 0, 1.0/2, 3.0/4, 1 };
+    return std::make_shared<EmbeddedRungeKutta>(rhs, a, b, bhat, c, 2);
+  }
+
+  // Dormand-Prince 5(4), FSAL with 6 new stages per step, with the
+  // continuous extension of order 4 by Shampine (Hairer-Norsett-Wanner I.6)
+  inline std::shared_ptr<EmbeddedRungeKutta> DormandPrince54 (std::shared_ptr<NonlinearFunction> rhs)
+  {
+    Matrix<> a(7, 7);
+    a = 0.0;
+    a(1,0) = 1.0/5;
+    a(2,0) = 3.0/40;        a(2,1) = 9.0/40;
+    a(3,0) = 44.0/45;       a(3,1) = -56.0/15;      a(3,2) = 32.0/9;
+    a(4,0) = 19372.0/6561;  a(4,1) = -25360.0/2187; a(4,2) = 64448.0/6561;  a(4,3) = -212.0/729;
+    a(5,0) = 9017.0/3168;   a(5,1) = -355.0/33;     a(5,2) = 46732.0/5247;  a(5,3) = 49.0/176;
+    a(5,4) = -5103.0/18656;
+    a(6,0) = 35.0/384;      a(6,2) = 500.0/1113;    a(6,3) = 125.0/192;     a(6,4) = -2187.0/6784;
+    a(6,5) = 11.0/84;
+    Vector<> b { 35.0/384, 0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84, 0 };
+    Vector<> bhat { 5179.0/57600, 0, 7571.0/16695, 393.0/640, -92097.0/339200, 187.0/2100, 1.0/40 };
+    Vector<> c { 0, 1.0/5, 3.0/10, 4.0/5, 8.0/9, 1, 1 };
+    Matrix<> bpoly(7, 4);
+    bpoly = 0.0;
+    bpoly(0,0) = 1;
+    bpoly(0,1) = -8048581381.0/2820520608;   bpoly(0,2) = 8663915743.0/2820520608;
+    bpoly(0,3) = -12715105075.0/11282082432;
+    bpoly(2,1) = 131558114200.0/32700410799; bpoly(2,2) = -68118460800.0/10900136933;
+    bpoly(2,3) = 87487479700.0/32700410799;
+    bpoly(3,1) = -1754552775.0/470086768;    bpoly(3,2) = 14199869525.0/1410260304;
+    bpoly(3,3) = -10690763975.0/1880347072;
+    bpoly(4,1) = 127303824393.0/49829197408; bpoly(4,2) = -318862633887.0/49829197408;
+    bpoly(4,3) = 701980252875.0/199316789632;
+    bpoly(5,1) = -282668133.0/205662961;     bpoly(5,2) = 2019193451.0/616988883;
+    bpoly(5,3) = -1453857185.0/822651844;
+    bpoly(6,1) = 40617522.0/29380423;        bpoly(6,2) = -110615467.0/29380423;
+    bpoly(6,3) = 69997945.0/29380423;
+    auto stepper = std::make_shared<EmbeddedRungeKutta>(rhs, a, b, bhat, c, 4);
+    stepper->setContinuousExtension(bpoly);
+    return stepper;
+  }
+
+
+  /*
+    PI step size controller (Gustafsson): the new step is
+      tau * safety * err^(-alpha) * errold^beta
+    with the scaled error err of this step and errold of the last accepted
+    one, alpha = 0.7/k, beta = 0.4/k for an error of order tau^k. The
+    errold factor damps the oscillation of the plain controller
+    tau * err^(-1/k) at the stability boundary.
+  */
+  class PIController
+  {
+    double m_alpha, m_beta;
+    double m_errold = 1e-4;
+    bool m_rejected = false;
+  public:
+    double safety = 0.9;
+    double facmin = 0.2;
+    double facmax = 5;
+
+    PIController (int errorder)
+      : m_alpha(0.7/(errorder+1)), m_beta(0.4/(errorder+1)) { }
+
+    // factor for the next step size after a step with scaled error err
+    double factor (double err)
+    {
+      if (!std::isfinite(err))
+        {
+          m_rejected = true;
+          return facmin;
+        }
+      err = std::max(err, 1e-10);
+      double fac = safety * std::pow(err, -m_alpha) * std::pow(m_errold, m_beta);
+      // no increase right after a rejection
+      fac = std::clamp(fac, facmin, m_rejected ? 1.0 : facmax);
+      if (err <= 1)
+        {
+          m_errold = err;
+          m_rejected = false;
+        }
+      else
+        m_rejected = true;
+      return fac;
+    }
+  };
+
+
+  struct AdaptiveStats
+  {
+    int accepted = 0;
+    int rejected = 0;
+    double tau = 0;       // proposed size of the next step
+  };
+
+
+  /*
+    Integrates y' = f(y) from t0 to tend with an embedded pair, keeping the
+    local error estimate below atol + rtol |y| by the PI controller, e.g.
+
+      AdaptiveIntegrator integrator(DormandPrince54(rhs));
+      integrator.rtol = 1e-8;
+      integrator.integrate(0, tend, y, [](double t, VectorView<double> y) { ... });
+
+    The callback is called after every accepted step.
+  */
+  class AdaptiveIntegrator
+  {
+    std::shared_ptr<EmbeddedRungeKutta> m_stepper;
+    Vector<> m_ynew;
+    AdaptiveStats m_stats;
+  public:
+    double rtol = 1e-6;
+    double atol = 1e-6;
+    double tauinit = 0;       // first step size, 0 for an estimate from f(y0)
+    double taumin = 1e-12;    // relative to tend-t0
+    int maxsteps = 10000000;
+
+    AdaptiveIntegrator (std::shared_ptr<EmbeddedRungeKutta> stepper)
+      : m_stepper(stepper), m_ynew(stepper->dimX()) { }
+
+    const AdaptiveStats & stats() const { return m_stats; }
+
+    void integrate (double t0, double tend, VectorView<double> y,
+                    std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      m_stats = AdaptiveStats();
+      PIController control(m_stepper->errorOrder());
+      m_stepper->reset();
+      double tau = tauinit > 0 ? tauinit : m_stepper->initialStep(y, rtol, atol);
+      tau = std::min(tau, tend-t0);
+
+      double t = t0;
+      while (t < tend)
+        {
+          if (m_stats.accepted + m_stats.rejected >= maxsteps)
+            throw std::domain_error("AdaptiveIntegrator: too many steps");
+          if (tau < taumin * (tend-t0))
+            throw std::domain_error("AdaptiveIntegrator: step size too small");
+
+          // stretch the last step instead of leaving a tiny remainder
+          bool last = t + 1.01 * tau >= tend;
+          if (last) tau = tend - t;
+
+          double err = m_stepper->step(tau, y, m_ynew, rtol, atol);
+          double fac = control.factor(err);
+          if (err <= 1)
+            {
+              t = last ? tend : t + tau;
+              y = m_ynew;
+              m_stepper->accept(y);
+              m_stats.accepted++;
+              if (callback) callback(t, y);
+            }
+          else
+            m_stats.rejected++;
+          tau *= fac;
+        }
+      m_stats.tau = tau;
+    }
+
+    // integrate with the callback called at t0, t0+dt, ... up to tend
+    // instead of after every step, with values from the stepper's dense
+    // output, so dt does not limit the step size
+    void integrate (double t0, double tend, double dt, VectorView<double> y,
+                    std::function<void(double,VectorView<double>)> callback)
+    {
+      m_stepper->enableDenseOutput();
+      Vector<> yout(y.size());
+      int nout = std::floor((tend-t0) / dt + 1e-9);
+      int k = 0;
+      double tprev = t0;
+      callback(t0, y);
+      integrate(t0, tend, y, [&](double t, VectorView<double> y)
+      {
+        for ( ; k < nout && t0 + (k+1)*dt <= t + 1e-12*dt; k++)
+          {
+            double tout = t0 + (k+1)*dt;
+            m_stepper->denseOutput((tout-tprev) / (t-tprev), yout);
+            callback(tout, yout);
+          }
+        tprev = t;
+      });
+    }
+  };
+
+}
+
+#endif
@@ -19,23 +19,67 @@ namespace ASC_ode {
     std::shared_ptr<NonlinearFunction> m_equ;
     std::shared_ptr<Parameter> m_tau;
     std::shared_ptr<ConstantFunction> m_yold;
+    Newton m_newton;
     int m_stages;
     int m_n;
     Vector<> m_k, m_y;
+    Matrix<> m_cinv;          // inverse of (c_j^i), for the collocation polynomial
+    Vector<> m_y0;            // start of the last successful tryStep
+    double m_lasttau = 0;     // its step size
+    bool m_colmethod = false; // a_ij = int_0^{c_i} L_j, a collocation method
+    bool m_collocation = false;
   public:
     ImplicitRungeKutta(std::shared_ptr<NonlinearFunction> rhs,
       const Matrix<> &a, const Vector<> &b, const Vector<> &c) 
     : TimeStepper(rhs), m_a(a), m_b(b), m_c(c),
     m_tau(std::make_shared<Parameter>(0.0)),
-    m_stages(c.size()), m_n(rhs->dimX()), m_k(m_stages*m_n), m_y(m_stages*m_n)
+    m_stages(c.size()), m_n(rhs->dimX()), m_k(m_stages*m_n), m_y(m_stages*m_n),
+    m_cinv(m_stages, m_stages), m_y0(m_n)
     {
+      // the Lagrange polynomials need pairwise distinct nodes, e.g. DIRK
+      // tableaus may repeat one
+      m_colmethod = true;
+      for (int i = 0; i < m_stages; i++)
+        for (int j = 0; j < i; j++)
+          if (std::fabs(c(i) - c(j)) <= 1e-12)
+            m_colmethod = false;
+
+      if (m_colmethod)
+        {
+          for (int i = 0; i < m_stages; i++)
+            for (int j = 0; j < m_stages; j++)
+              m_cinv(i,j) = std::pow(c(j), i);
+          calcInverse(m_cinv);
+        }
+
+      for (int i = 0; i < m_stages && m_colmethod; i++)
+        for (int j = 0; j < m_stages; j++)
+          {
+            double aij = 0, pow = c(i);
+            for (int l = 0; l < m_stages; l++, pow *= c(i))
+              aij += m_cinv(j,l) * pow / (l+1);
+            if (!(std::fabs(aij - a(i,j)) <= 1e-10 * (1 + std::fabs(a(i,j)))))
+              m_colmethod = false;
+          }
+
       auto multiple_rhs = make_shared<MultipleFunc>(rhs, m_stages);
       m_yold = std::make_shared<ConstantFunction>(m_stages*m_n);
       auto knew = std::make_shared<IdentityFunction>(m_stages*m_n);
-      m_equ = knew - Compose(multiple_rhs, m_yold+m_tau*std::make_shared<MatVecFunc>(a, m_n));
+      auto matvec = std::make_shared<MatVecFunc>(a, m_n);
+      m_equ = MakeExprFunction(Expr(knew) - Compose(Expr(multiple_rhs), m_yold + m_tau*Expr(matvec)));
     }
 
     void doStep(double tau, VectorView<double> y) override
+    {
+      beginStep(y);
+      m_lasttau = 0;
+      stepWithHalving(tau, y);
+      endStep(tau, y);
+      // halved steps leave the polynomial of the last piece only
+      m_collocation = m_colmethod && m_lasttau == tau;
+    }
+
+    bool tryStep(double tau, VectorView<double> y) override
     {
       for (int j = 0; j < m_stages; j++)
         m_y.range(j*m_n, (j+1)*m_n) = y;
@@ -43,11 +87,42 @@ namespace ASC_ode {
 
       m_tau->set(tau);
       m_k = 0.0;  
-      NewtonSolver(m_equ, m_k);
+      if (m_newton.trySolve(m_equ, m_k) != NewtonStatus::Converged)
+        return false;
 
+      m_y0 = y;
+      m_lasttau = tau;
       for (int j = 0; j < m_stages; j++)
         y += tau * m_b(j) * m_k.range(j*m_n, (j+1)*m_n);
+      return true;
     }
+
+    // For collocation methods (checked in the constructor), e.g. a from
+    // computeABfromC, the collocation polynomial
+    //   y0 + tau sum_j k_j int_0^theta L_j
+    // with the Lagrange polynomials L_j of the nodes c; it has the order of
+    // the stage values. Other tableaus, and steps that were halved, use
+    // Hermite interpolation.
+    void denseOutput(double theta, VectorView<double> y) override
+    {
+      if (!m_collocation || !m_denseoutput)
+        {
+          TimeStepper::denseOutput(theta, y);
+          return;
+        }
+      y = m_y0;
+      for (int j = 0; j < m_stages; j++)
+        {
+          // int_0^theta L_j = sum_i cinv(j,i) theta^(i+1)/(i+1)
+          double w = 0, pow = theta;
+          for (int i = 0; i < m_stages; i++, pow *= theta)
+            w += m_cinv(j,i) * pow / (i+1);
+          y += m_lasttau * w * m_k.range(j*m_n, (j+1)*m_n);
+        }
+    }
+
+    // solver settings, e.g. the Jacobian refresh rule
+    Newton & newton() { return m_newton; }
   };
 
 
@@ -0,0 +1,705 @@
+#ifndef LINEARSOLVER_HPP
+#define LINEARSOLVER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <vector.hpp>
+#include <matrix.hpp>
+
+#include "nonlinfunc.hpp"
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+  // LU factorization with partial pivoting, P A = L U. L (unit diagonal)
+  // and U are stored in one row-major array of type T, the factors are
+  // kept for any number of solves. Solves run in double precision also
+  // for T = float.
+  template <typename T = double>
+  class DenseLU
+  {
+    size_t m_n = 0;
+    std::vector<T> m_lu;
+    std::vector<size_t> m_piv;
+
+    T & lu (size_t i, size_t j) { return m_lu[i*m_n+j]; }
+    T lu (size_t i, size_t j) const { return m_lu[i*m_n+j]; }
+
+  public:
+    DenseLU () = default;
+    DenseLU (MatrixView<double> a) { factor(a); }
+
+    size_t size() const { return m_n; }
+
+    void factor (MatrixView<double> a)
+    {
+      m_n = a.rows();
+      m_lu.resize(m_n*m_n);
+      m_piv.resize(m_n);
+      for (size_t i = 0; i < m_n; i++)
+        for (size_t j = 0; j < m_n; j++)
+          lu(i,j) = a(i,j);
+
+      for (size_t k = 0; k < m_n; k++)
+        {
+          size_t p = k;
+          for (size_t i = k+1; i < m_n; i++)
+            if (std::fabs(lu(i,k)) > std::fabs(lu(p,k))) p = i;
+          m_piv[k] = p;
+          if (lu(p,k) == 0)
+            throw std::domain_error("DenseLU: matrix is singular");
+          if (p != k)
+            for (size_t j = 0; j < m_n; j++)
+              std::swap(lu(k,j), lu(p,j));
+
+          T inv = T(1) / lu(k,k);
+          for (size_t i = k+1; i < m_n; i++)
+            {
+              T lik = (lu(i,k) *= inv);
+              if (lik == 0) continue;
+              for (size_t j = k+1; j < m_n; j++)
+                lu(i,j) -= lik * lu(k,j);
+            }
+        }
+    }
+
+    // b <- A^{-1} b
+    void solve (VectorView<double> b) const
+    {
+      for (size_t k = 0; k < m_n; k++)
+        if (m_piv[k] != k)
+          std::swap(b(k), b(m_piv[k]));
+
+      for (size_t i = 1; i < m_n; i++)
+        {
+          double sum = b(i);
+          for (size_t j = 0; j < i; j++)
+            sum -= lu(i,j) * b(j);
+          b(i) = sum;
+        }
+
+      for (size_t i = m_n; i-- > 0; )
+        {
+          double sum = b(i);
+          for (size_t j = i+1; j < m_n; j++)
+            sum -= lu(i,j) * b(j);
+          b(i) = sum / lu(i,i);
+        }
+    }
+  };
+
+
+  // Linear solver for the Newton update J dx = f. It assembles the
+  // Jacobian of func in its own format, factors it, and solves with the
+  // factors as often as needed.
+  class LinearSolver
+  {
+  public:
+    virtual ~LinearSolver() = default;
+
+    // f = func(x), and the Jacobian of func at x
+    virtual void assemble (const NonlinearFunction & func, VectorView<double> x, VectorView<double> f) = 0;
+    // factor the assembled Jacobian, throws std::domain_error if it is singular
+    virtual void factor () = 0;
+    // b <- J^{-1} b
+    virtual void solve (VectorView<double> b) const = 0;
+    // dimension of the current factorization, 0 if there is none
+    virtual size_t size() const = 0;
+  };
+
+
+  class DenseLUSolver : public LinearSolver
+  {
+    std::vector<double> m_jac;
+    size_t m_n = 0;
+    DenseLU<> m_lu;
+  public:
+    void assemble (const NonlinearFunction & func, VectorView<double> x, VectorView<double> f) override
+    {
+      m_n = func.dimX();
+      func.evaluateWithDeriv(x, f, ScratchMatrix(m_jac, m_n, m_n));
+    }
+
+    void factor () override { m_lu.factor(ScratchMatrix(m_jac, m_n, m_n)); }
+    void solve (VectorView<double> b) const override { m_lu.solve(b); }
+    size_t size() const override { return m_lu.size(); }
+  };
+
+
+  // f(std::integral_constant<size_t,I>()) for I = 0 ... N-1, unrolled at
+  // compile time
+  template <size_t N, typename F>
+  inline void Unroll (F && f)
+  {
+    [&]<size_t... I> (std::index_sequence<I...>)
+    {
+      (f(std::integral_constant<size_t,I>()), ...);
+    } (std::make_index_sequence<N>());
+  }
+
+
+  // DenseLU for a compile-time dimension N. The factors live in a fixed
+  // array and the elimination is unrolled, so for a few unknowns there is
+  // no allocation and no loop overhead.
+  template <size_t N>
+  class SmallLU
+  {
+    std::array<double,N*N> m_lu;
+    std::array<size_t,N> m_piv;
+
+  public:
+    void factor (const std::array<double,N*N> & a)
+    {
+      m_lu = a;
+      Unroll<N>([&](auto K)
+      {
+        constexpr size_t k = K;
+        size_t p = k;
+        for (size_t i = k+1; i < N; i++)
+          if (std::fabs(m_lu[i*N+k]) > std::fabs(m_lu[p*N+k])) p = i;
+        m_piv[k] = p;
+        if (m_lu[p*N+k] == 0)
+          throw std::domain_error("SmallLU: matrix is singular");
+        if (p != k)
+          for (size_t j = 0; j < N; j++)
+            std::swap(m_lu[k*N+j], m_lu[p*N+j]);
+
+        double inv = 1.0 / m_lu[k*N+k];
+        for (size_t i = k+1; i < N; i++)
+          {
+            double lik = (m_lu[i*N+k] *= inv);
+            for (size_t j = k+1; j < N; j++)
+              m_lu[i*N+j] -= lik * m_lu[k*N+j];
+          }
+      });
+    }
+
+    // b <- A^{-1} b
+    void solve (VectorView<double> b) const
+    {
+      std::array<double,N> y;
+      for (size_t i = 0; i < N; i++)
+        y[i] = b(i);
+      for (size_t k = 0; k < N; k++)
+        std::swap(y[k], y[m_piv[k]]);
+
+      for (size_t i = 1; i < N; i++)
+        for (size_t j = 0; j < i; j++)
+          y[i] -= m_lu[i*N+j] * y[j];
+
+      for (size_t i = N; i-- > 0; )
+        {
+          for (size_t j = i+1; j < N; j++)
+            y[i] -= m_lu[i*N+j] * y[j];
+          y[i] /= m_lu[i*N+i];
+        }
+
+      for (size_t i = 0; i < N; i++)
+        b(i) = y[i];
+    }
+  };
+
+
+  // For systems of exactly N unknowns: Jacobian and factors are fixed-size
+  // arrays inside the solver object, so assembly and factorization do no
+  // dynamic allocation
+  template <size_t N>
+  class SmallLUSolver : public LinearSolver
+  {
+    std::array<double,N*N> m_jac;
+    SmallLU<N> m_lu;
+    bool m_factored = false;
+  public:
+    void assemble (const NonlinearFunction & func, VectorView<double> x, VectorView<double> f) override
+    {
+      func.evaluateWithDeriv(x, f, MatrixView<double>(N, N, N, m_jac.data()));
+    }
+
+    void factor () override
+    {
+      m_factored = false;
+      m_lu.factor(m_jac);
+      m_factored = true;
+    }
+
+    void solve (VectorView<double> b) const override { m_lu.solve(b); }
+    size_t size() const override { return m_factored ? N : 0; }
+  };
+
+
+  // systems up to this size get a SmallLUSolver. Every size is its own
+  // instantiation with fully unrolled loops, so the code grows with N^2,
+  // while the gain over DenseLU shrinks to about 1.3 already for N = 4
+  // (see demos/test_smalllu.cpp)
+  constexpr size_t SmallLUMaxDim = 12;
+
+  // SmallLUSolver<n> for 1 <= n <= SmallLUMaxDim, nullptr otherwise
+  template <size_t N = 1>
+  inline std::shared_ptr<LinearSolver> MakeSmallLUSolver (size_t n)
+  {
+    if constexpr (N > SmallLUMaxDim)
+      return nullptr;
+    else
+      {
+        if (n == N) return std::make_shared<SmallLUSolver<N>>();
+        return MakeSmallLUSolver<N+1>(n);
+      }
+  }
+
+
+  /*
+    Dense LU in single precision: half the memory traffic of the double
+    factorization and faster to factor. The update is recovered to double
+    accuracy by iterative refinement against the double Jacobian,
+    dx += LU^{-1} (f - J dx), which keeps the one-solve path for affine
+    systems accurate. In the Newton iteration the residual is always
+    evaluated in double, which refines further.
+  */
+  class MixedLUSolver : public LinearSolver
+  {
+    std::vector<double> m_jac;
+    mutable std::vector<double> m_rhs, m_corr;
+    size_t m_n = 0;
+    int m_refinements;
+    DenseLU<float> m_lu;
+  public:
+    MixedLUSolver (int refinements = 2) : m_refinements(refinements) { }
+
+    void assemble (const NonlinearFunction & func, VectorView<double> x, VectorView<double> f) override
+    {
+      m_n = func.dimX();
+      func.evaluateWithDeriv(x, f, ScratchMatrix(m_jac, m_n, m_n));
+    }
+
+    void factor () override { m_lu.factor(ScratchMatrix(m_jac, m_n, m_n)); }
+
+    void solve (VectorView<double> b) const override
+    {
+      auto rhs = ScratchVector(m_rhs, m_n);
+      auto corr = ScratchVector(m_corr, m_n);
+      rhs = b;
+      m_lu.solve(b);
+      for (int k = 0; k < m_refinements; k++)
+        {
+          for (size_t i = 0; i < m_n; i++)
+            {
+              double sum = rhs(i);
+              for (size_t j = 0; j < m_n; j++)
+                sum -= m_jac[i*m_n+j] * b(j);
+              corr(i) = sum;
+            }
+          m_lu.solve(corr);
+          b += corr;
+        }
+    }
+
+    size_t size() const override { return m_lu.size(); }
+  };
+
+
+  // Reverse Cuthill-McKee ordering of the symmetrized pattern. It reduces
+  // the bandwidth and profile, so the fill-in of an LU without pivoting
+  // stays inside the envelope; it does not minimize the fill-in like a
+  // minimum degree ordering. Returns perm with perm[new index] = old index.
+  inline std::vector<size_t> ReverseCuthillMcKee (const std::vector<std::vector<size_t>> & graph)
+  {
+    size_t n = graph.size();
+    std::vector<size_t> order;
+    order.reserve(n);
+    std::vector<bool> visited(n, false);
+
+    auto degree = [&](size_t i) { return graph[i].size(); };
+    std::vector<size_t> bydegree(n);
+    for (size_t i = 0; i < n; i++) bydegree[i] = i;
+    std::stable_sort(bydegree.begin(), bydegree.end(),
+                     [&](size_t a, size_t b) { return degree(a) < degree(b); });
+
+    // one breadth-first search per connected component, started at a
+    // node of minimal degree, neighbours in order of increasing degree
+    for (size_t start : bydegree)
+      {
+        if (visited[start]) continue;
+        size_t first = order.size();
+        order.push_back(start);
+        visited[start] = true;
+        for (size_t k = first; k < order.size(); k++)
+          {
+            size_t begin = order.size();
+            for (size_t j : graph[order[k]])
+              if (!visited[j])
+                {
+                  visited[j] = true;
+                  order.push_back(j);
+                }
+            std::stable_sort(order.begin()+begin, order.end(),
+                             [&](size_t a, size_t b) { return degree(a) < degree(b); });
+          }
+      }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+
+
+  /*
+    Sparse LU factorization without pivoting, for the structurally
+    symmetrized Jacobian pattern. The symbolic analysis (RCM ordering,
+    elimination tree, fill-in pattern of L and U) is done once per
+    Jacobian pattern and reused by all later factorizations, only the
+    numeric factorization is repeated. The pattern is rebuilt and compared
+    at every assembly, which costs O(nonzeros).
+
+    Without pivoting the pivots must stay away from zero, which holds for
+    the diagonally dominant I - tau J matrices of implicit methods with
+    small tau, but not for general nonsymmetric Jacobians. If a pivot is
+    tiny compared to its row, this factorization is dropped in favour of
+    a DenseLU with partial pivoting of the same matrix.
+  */
+  class SparseLUSolver : public LinearSolver
+  {
+    SparsityPattern m_pattern { 0, 0 };
+    std::unique_ptr<SparseMatrix> m_jac;
+    size_t m_n = 0;
+    bool m_factored = false;
+    bool m_dense = false;                            // m_denselu is in use
+    DenseLU<> m_denselu;
+
+    std::vector<size_t> m_perm, m_iperm;             // perm[new] = old
+    std::vector<size_t> m_firstl, m_coll;            // L, strictly lower, by rows
+    std::vector<size_t> m_firstu, m_colu;            // U, diagonal first, by rows
+    std::vector<double> m_vall, m_valu;
+    mutable std::vector<double> m_work;
+
+    void analyze (const SparsityPattern & pattern)
+    {
+      m_n = pattern.height();
+
+      // symmetrized graph without the diagonal
+      std::vector<std::vector<size_t>> graph(m_n);
+      for (size_t i = 0; i < m_n; i++)
+        for (size_t j : pattern.row(i))
+          if (i != j)
+            {
+              graph[i].push_back(j);
+              graph[j].push_back(i);
+            }
+      for (auto & nb : graph)
+        {
+          std::sort(nb.begin(), nb.end());
+          nb.erase(std::unique(nb.begin(), nb.end()), nb.end());
+        }
+
+      m_perm = ReverseCuthillMcKee(graph);
+      m_iperm.resize(m_n);
+      for (size_t i = 0; i < m_n; i++)
+        m_iperm[m_perm[i]] = i;
+
+      // row structure of L: walk up the elimination tree from every
+      // lower entry of the permuted row, stop at nodes already found
+      std::vector<size_t> parent(m_n), mark(m_n);
+      const size_t none = m_n;
+      std::vector<std::vector<size_t>> lrows(m_n);
+      for (size_t i = 0; i < m_n; i++)
+        {
+          parent[i] = none;
+          mark[i] = i;
+          for (size_t jold : graph[m_perm[i]])
+            for (size_t k = m_iperm[jold]; k < i && mark[k] != i; k = parent[k])
+              {
+                lrows[i].push_back(k);
+                mark[k] = i;
+                if (parent[k] == none) parent[k] = i;
+              }
+          std::sort(lrows[i].begin(), lrows[i].end());
+        }
+
+      m_firstl.assign(m_n+1, 0);
+      m_coll.clear();
+      for (size_t i = 0; i < m_n; i++)
+        {
+          m_coll.insert(m_coll.end(), lrows[i].begin(), lrows[i].end());
+          m_firstl[i+1] = m_coll.size();
+        }
+
+      // U has the transposed structure of L
+      std::vector<std::vector<size_t>> urows(m_n);
+      for (size_t i = 0; i < m_n; i++)
+        {
+          urows[i].push_back(i);
+          for (size_t k : lrows[i])
+            urows[k].push_back(i);
+        }
+      m_firstu.assign(m_n+1, 0);
+      m_colu.clear();
+      for (size_t i = 0; i < m_n; i++)
+        {
+          m_colu.insert(m_colu.end(), urows[i].begin(), urows[i].end());
+          m_firstu[i+1] = m_colu.size();
+        }
+
+      m_vall.resize(m_coll.size());
+      m_valu.resize(m_colu.size());
+      m_work.assign(m_n, 0.0);
+    }
+
+    // tiny pivot: DenseLU with partial pivoting of the whole matrix
+    void factorDense ()
+    {
+      std::fill(m_work.begin(), m_work.end(), 0.0);
+      Matrix<double> dense(m_n, m_n);
+      m_jac->toDense(dense);
+      m_denselu.factor(dense);
+      m_dense = true;
+      m_factored = true;
+    }
+
+  public:
+    // pivots below this fraction of the largest entry of their row switch
+    // to the dense factorization
+    static constexpr double PivotTol = 1e-8;
+
+    void assemble (const NonlinearFunction & func, VectorView<double> x, VectorView<double> f) override
+    {
+      auto pattern = func.derivPattern();
+      if (!m_jac || !(pattern == m_pattern))
+        {
+          m_jac = std::make_unique<SparseMatrix>(pattern);
+          analyze(pattern);
+          m_pattern = std::move(pattern);
+          m_factored = false;
+        }
+      func.evaluate(x, f);
+      func.evaluateDerivSparse(x, *m_jac);
+    }
+
+    // up-looking row LU: row i of A minus the combinations of earlier rows of U
+    void factor () override
+    {
+      m_factored = m_dense = false;
+      auto & w = m_work;
+      for (size_t i = 0; i < m_n; i++)
+        {
+          size_t iold = m_perm[i];
+          double rowmax = 0;
+          for (size_t k = m_jac->firstInRow(iold); k < m_jac->nextInRow(iold); k++)
+            {
+              w[m_iperm[m_jac->colNr(k)]] = m_jac->value(k);
+              rowmax = std::max(rowmax, std::fabs(m_jac->value(k)));
+            }
+
+          for (size_t kl = m_firstl[i]; kl < m_firstl[i+1]; kl++)
+            {
+              size_t k = m_coll[kl];
+              double lik = w[k] / m_valu[m_firstu[k]];
+              w[k] = 0;
+              m_vall[kl] = lik;
+              if (lik == 0) continue;
+              for (size_t ku = m_firstu[k]+1; ku < m_firstu[k+1]; ku++)
+                w[m_colu[ku]] -= lik * m_valu[ku];
+            }
+
+          if (!(std::fabs(w[i]) > PivotTol * rowmax))
+            {
+              factorDense();
+              return;
+            }
+          for (size_t ku = m_firstu[i]; ku < m_firstu[i+1]; ku++)
+            {
+              m_valu[ku] = w[m_colu[ku]];
+              w[m_colu[ku]] = 0;
+            }
+        }
+      m_factored = true;
+    }
+
+    void solve (VectorView<double> b) const override
+    {
+      if (m_dense)
+        {
+          m_denselu.solve(b);
+          return;
+        }
+      auto & y = m_work;
+      for (size_t i = 0; i < m_n; i++)
+        y[i] = b(m_perm[i]);
+
+      for (size_t i = 0; i < m_n; i++)
+        for (size_t kl = m_firstl[i]; kl < m_firstl[i+1]; kl++)
+          y[i] -= m_vall[kl] * y[m_coll[kl]];
+
+      for (size_t i = m_n; i-- > 0; )
+        {
+          double sum = y[i];
+          for (size_t ku = m_firstu[i]+1; ku < m_firstu[i+1]; ku++)
+            sum -= m_valu[ku] * y[m_colu[ku]];
+          y[i] = sum / m_valu[m_firstu[i]];
+        }
+
+      for (size_t i = 0; i < m_n; i++)
+        {
+          b(m_perm[i]) = y[i];
+          y[i] = 0;
+        }
+    }
+
+    size_t size() const override { return m_factored ? m_n : 0; }
+
+    // nonzeros of L and U, including fill-in
+    size_t nze() const { return m_coll.size() + m_colu.size(); }
+
+    // the last factor() fell back to DenseLU
+    bool usedDense() const { return m_dense; }
+  };
+
+
+  // LU factorization with partial pivoting of a band matrix with lower
+  // bandwidth kl and upper bandwidth ku. Row interchanges widen U to kl+ku
+  // upper diagonals, so every row stores the columns i-kl ... i+kl+ku.
+  // Costs O(n kl (kl+ku)) instead of O(n^3).
+  class BandedLU
+  {
+    size_t m_n = 0, m_kl = 0, m_ku = 0, m_width = 1;
+    std::vector<double> m_band;
+    std::vector<size_t> m_piv;
+
+    size_t last (size_t i, size_t offset) const { return std::min(m_n-1, i+offset); }
+
+  public:
+    size_t size() const { return m_n; }
+
+    // set the shape and clear all entries
+    void setSize (size_t n, size_t kl, size_t ku)
+    {
+      m_n = n;
+      m_kl = kl;
+      m_ku = ku;
+      m_width = 2*kl+ku+1;
+      m_band.assign(m_n*m_width, 0.0);
+      m_piv.resize(m_n);
+    }
+
+    // entry (i,j) with i-kl <= j <= i+kl+ku
+    double & operator() (size_t i, size_t j) { return m_band[i*m_width + j+m_kl-i]; }
+    double operator() (size_t i, size_t j) const { return m_band[i*m_width + j+m_kl-i]; }
+
+    void factor ()
+    {
+      auto & a = *this;
+      for (size_t k = 0; k < m_n; k++)
+        {
+          size_t p = k;
+          for (size_t i = k+1; i <= last(k, m_kl); i++)
+            if (std::fabs(a(i,k)) > std::fabs(a(p,k))) p = i;
+          m_piv[k] = p;
+          if (a(p,k) == 0)
+            throw std::domain_error("BandedLU: matrix is singular");
+          if (p != k)
+            for (size_t j = k; j <= last(k, m_kl+m_ku); j++)
+              std::swap(a(k,j), a(p,j));
+
+          double inv = 1.0 / a(k,k);
+          for (size_t i = k+1; i <= last(k, m_kl); i++)
+            {
+              double lik = (a(i,k) *= inv);
+              if (lik == 0) continue;
+              for (size_t j = k+1; j <= last(k, m_kl+m_ku); j++)
+                a(i,j) -= lik * a(k,j);
+            }
+        }
+    }
+
+    // b <- A^{-1} b, interchanges and eliminations in the order of factor
+    void solve (VectorView<double> b) const
+    {
+      auto & a = *this;
+      for (size_t k = 0; k < m_n; k++)
+        {
+          if (m_piv[k] != k)
+            std::swap(b(k), b(m_piv[k]));
+          for (size_t i = k+1; i <= last(k, m_kl); i++)
+            b(i) -= a(i,k) * b(k);
+        }
+
+      for (size_t i = m_n; i-- > 0; )
+        {
+          double sum = b(i);
+          for (size_t j = i+1; j <= last(i, m_kl+m_ku); j++)
+            sum -= a(i,j) * b(j);
+          b(i) = sum / a(i,i);
+        }
+    }
+  };
+
+
+  // Newton backend for banded Jacobians, e.g. chains of masses and 1D
+  // discretizations. The Jacobian is assembled through the sparse interface.
+  class BandedLUSolver : public LinearSolver
+  {
+    SparsityPattern m_pattern { 0, 0 };
+    std::unique_ptr<SparseMatrix> m_jac;
+    Bandwidth m_bw;
+    BandedLU m_lu;
+    bool m_factored = false;
+
+  public:
+    void assemble (const NonlinearFunction & func, VectorView<double> x, VectorView<double> f) override
+    {
+      auto pattern = func.derivPattern();
+      if (!m_jac || !(pattern == m_pattern))
+        {
+          m_bw = pattern.bandwidth();
+          m_jac = std::make_unique<SparseMatrix>(pattern);
+          m_pattern = std::move(pattern);
+          m_factored = false;
+        }
+      func.evaluate(x, f);
+      func.evaluateDerivSparse(x, *m_jac);
+    }
+
+    void factor () override
+    {
+      auto & jac = *m_jac;
+      m_lu.setSize(jac.height(), m_bw.lower, m_bw.upper);
+      for (size_t i = 0; i < jac.height(); i++)
+        for (size_t k = jac.firstInRow(i); k < jac.nextInRow(i); k++)
+          m_lu(i, jac.colNr(k)) = jac.value(k);
+      m_lu.factor();
+      m_factored = true;
+    }
+
+    void solve (VectorView<double> b) const override { m_lu.solve(b); }
+    size_t size() const override { return m_factored ? m_lu.size() : 0; }
+  };
+
+
+  // A banded LU with partial pivoting stores 2*kl+ku+1 entries per row and
+  // costs about n*kl*(kl+ku) operations against n^3/3 for the dense LU.
+  // It also rebuilds the pattern at every assembly, so it is only chosen
+  // if its row is at most this fraction of the dense row.
+  constexpr size_t BandedLUMinRatio = 4;
+
+  // unrolled LU for tiny systems, banded LU if the band is narrow compared
+  // to the dimension, dense LU otherwise. The MixedLUSolver changes the
+  // accuracy of the factorization and is never chosen automatically.
+  inline std::shared_ptr<LinearSolver> ChooseLinearSolver (const NonlinearFunction & func)
+  {
+    size_t n = func.dimX();
+    if (n <= SmallLUMaxDim && n == func.dimF())
+      if (auto small = MakeSmallLUSolver(n))
+        return small;
+    auto bw = func.bandwidth();
+    if (BandedLUMinRatio * (2*bw.lower+bw.upper+1) <= n)
+      return std::make_shared<BandedLUSolver>();
+    return std::make_shared<DenseLUSolver>();
+  }
+
+}
+
+#endif
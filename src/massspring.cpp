@@ -19,6 +19,9 @@ public:
 
     size_t dimX() const override { return 2; }
     size_t dimF() const override { return 2; }
+    bool isThreadSafe() const override { return true; }
+    bool isAffine() const override { return true; }
+    size_t jacobianVersion() const override { return 0; }
 
     void evaluate(VectorView<double> x, VectorView<double> f) const override
     {
@@ -32,5 +35,15 @@ public:
         df(0, 1) = 1.0;
         df(1, 0) = -stiffness / mass;
     }
+
+    void evaluateBatch(MatrixView<double> x, MatrixView<double> f) const override
+    {
+        double fac = -stiffness / mass;
+        for (size_t j = 0; j < x.cols(); j++)
+        {
+            f(0, j) = x(1, j);
+            f(1, j) = fac * x(0, j);
+        }
+    }
 };
 
@@ -0,0 +1,430 @@
+#ifndef MULTISTEP_HPP
+#define MULTISTEP_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+#include <vector.hpp>
+
+#include "timestepper.hpp"
+#include "embeddedRK.hpp"
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+
+  // the last values of a vector-valued sequence, newest first
+  class HistoryBuffer
+  {
+    size_t m_n, m_capacity;
+    std::vector<double> m_data;
+    std::vector<double> m_times;
+    size_t m_head = 0, m_count = 0;
+
+    size_t slot (size_t j) const { return (m_head + m_capacity - j) % m_capacity; }
+
+  public:
+    HistoryBuffer (size_t n, size_t capacity)
+      : m_n(n), m_capacity(capacity), m_data(n*capacity), m_times(capacity) { }
+
+    size_t size() const { return m_count; }
+    void clear() { m_count = 0; }
+
+    // j-th last entry, j = 0 is the newest
+    VectorView<double> operator[] (size_t j) { return VectorView<double>(m_n, m_data.data()+slot(j)*m_n); }
+    double time (size_t j) const { return m_times[slot(j)]; }
+
+    void push (double t, VectorView<double> v)
+    {
+      m_head = (m_head+1) % m_capacity;
+      m_count = std::min(m_count+1, m_capacity);
+      m_times[m_head] = t;
+      (*this)[0] = v;
+    }
+  };
+
+
+  /*
+    Adams-Bashforth-Moulton predictor-corrector of order k = 1 ... 5 with
+    constant step size:
+      P: y_p = y_n + tau sum_j beta_j f_{n-j}        (k-step Adams-Bashforth)
+      E: f_p = f(y_p)
+      C: y_{n+1} = y_n + tau (beta*_0 f_p + sum_j beta*_j f_{n+1-j})   (Adams-Moulton)
+      E: f_{n+1} = f(y_{n+1})
+    The last evaluation is skipped with pece = false (PEC mode, f_p is
+    stored instead), so a step costs one or two rhs evaluations. The first
+    k-1 steps, and the first ones after a change of tau or of y between
+    steps, are RK4 steps.
+  */
+  class AdamsBashforthMoulton : public TimeStepper
+  {
+    static constexpr double AB[5][5] = {
+      { 1 },
+      { 3.0/2, -1.0/2 },
+      { 23.0/12, -16.0/12, 5.0/12 },
+      { 55.0/24, -59.0/24, 37.0/24, -9.0/24 },
+      { 1901.0/720, -2774.0/720, 2616.0/720, -1274.0/720, 251.0/720 } };
+    static constexpr double AM[5][5] = {
+      { 1 },
+      { 1.0/2, 1.0/2 },
+      { 5.0/12, 8.0/12, -1.0/12 },
+      { 9.0/24, 19.0/24, -5.0/24, 1.0/24 },
+      { 251.0/720, 646.0/720, -264.0/720, 106.0/720, -19.0/720 } };
+
+    int m_order;
+    HistoryBuffer m_f;       // f_n, f_{n-1}, ...
+    double m_tau = 0;
+    Vector<> m_ylast, m_yp, m_fp;
+    RungeKutta4 m_start;
+
+  public:
+    bool pece = true;
+
+    AdamsBashforthMoulton(std::shared_ptr<NonlinearFunction> rhs, int order = 4)
+      : TimeStepper(rhs), m_order(order), m_f(rhs->dimX(), order),
+        m_ylast(rhs->dimX()), m_yp(rhs->dimX()), m_fp(rhs->dimX()), m_start(rhs)
+    {
+      if (order < 1 || order > 5)
+        throw std::invalid_argument("AdamsBashforthMoulton: order must be 1 ... 5");
+    }
+
+    // the next step starts a new history
+    void reset() { m_f.clear(); }
+
+    void doStep(double tau, VectorView<double> y) override
+    {
+      beginStep(y);
+      if (m_f.size() > 0 && tau != m_tau)
+        m_f.clear();
+      if (m_f.size() > 0)
+        for (size_t l = 0; l < y.size(); l++)
+          if (y(l) != m_ylast(l))
+            {
+              m_f.clear();
+              break;
+            }
+      if (m_f.size() == 0)
+        {
+          m_rhs->evaluate(y, m_fp);
+          m_f.push(0, m_fp);
+        }
+
+      size_t n = y.size();
+      if (m_f.size() < size_t(m_order))
+        {
+          m_start.doStep(tau, y);
+          m_rhs->evaluate(y, m_fp);
+        }
+      else
+        {
+          const double * ab = AB[m_order-1];
+          const double * am = AM[m_order-1];
+          for (size_t l = 0; l < n; l++)
+            {
+              double sum = 0;
+              for (int j = 0; j < m_order; j++)
+                sum += ab[j] * m_f[j](l);
+              m_yp(l) = y(l) + tau * sum;
+            }
+          m_rhs->evaluate(m_yp, m_fp);
+          for (size_t l = 0; l < n; l++)
+            {
+              double sum = am[0] * m_fp(l);
+              for (int j = 1; j < m_order; j++)
+                sum += am[j] * m_f[j-1](l);
+              y(l) += tau * sum;
+            }
+          if (pece)
+            m_rhs->evaluate(y, m_fp);
+        }
+      m_f.push(0, m_fp);
+      m_tau = tau;
+      m_ylast = y;
+      endStep(tau, y);
+    }
+  };
+
+
+  /*
+    Backward differentiation formulas of order q = 1 ... 5 with variable
+    step size: y_{n+1} solves
+      p'(t_{n+1}) = f(y_{n+1})
+    for the polynomial p interpolating y_{n+1}, y_n, ..., y_{n+1-q} at
+    their actual times, so the coefficients are recomputed for every step
+    from the history and steps may change freely. The equation is
+    y - gamma f(y) - ybar = 0 with parameters gamma and ybar, so Newton
+    keeps its factorization across steps while gamma changes slowly.
+
+    doStep runs with the given tau at order maxorder, after a startup
+    over the first steps with error control by rtol and atol to fill the
+    history. integrate chooses step size and order from
+    the local error estimates: the corrector minus the extrapolation of
+    the history, (y_{n+1} - y_pred) / (q+1), for the orders q-1, q and q+1.
+  */
+  class BDF : public TimeStepper
+  {
+    static constexpr int MaxOrder = 5;
+
+    std::shared_ptr<NonlinearFunction> m_equ;
+    std::shared_ptr<Parameter> m_gamma;
+    std::shared_ptr<ConstantFunction> m_ybar;
+    Newton m_newton;
+    size_t m_n;
+    HistoryBuffer m_y;           // y_n, y_{n-1}, ... with their times
+    int m_order = 1;
+    int m_sameorder = 0;         // steps since the last order change
+    double m_tau = 0;            // proposed next step, 0 if none yet
+    Vector<> m_ypred, m_ynew, m_work;
+    AdaptiveStats m_stats;
+
+    // weights of the Lagrange polynomial through the m newest history
+    // points, evaluated at t
+    void extrapolationWeights (double t, size_t m, double * w) const
+    {
+      for (size_t j = 0; j < m; j++)
+        {
+          w[j] = 1;
+          for (size_t i = 0; i < m; i++)
+            if (i != j)
+              w[j] *= (t - m_y.time(i)) / (m_y.time(j) - m_y.time(i));
+        }
+    }
+
+    // z = extrapolation of the m newest points to t_n + tau; with a single
+    // point an explicit Euler step
+    void predict (double tau, size_t m, VectorView<double> z)
+    {
+      if (m == 1)
+        {
+          m_rhs->evaluate(m_y[0], z);
+          z *= tau;
+          z += m_y[0];
+          return;
+        }
+      double w[MaxOrder+1];
+      extrapolationWeights(m_y.time(0)+tau, m, w);
+      z = 0.0;
+      for (size_t j = 0; j < m; j++)
+        z += w[j] * m_y[j];
+    }
+
+    // y_{n+1} of order q into y, which holds the initial guess
+    bool solve (double tau, int q, VectorView<double> y)
+    {
+      // nodes x_0 = t_{n+1}, x_{j+1} = t_{n-j}; alpha_j = L_j'(x_0)
+      double x[MaxOrder+1];
+      x[0] = m_y.time(0) + tau;
+      for (int j = 0; j < q; j++)
+        x[j+1] = m_y.time(j);
+
+      double alpha0 = 0;
+      for (int m = 1; m <= q; m++)
+        alpha0 += 1 / (x[0] - x[m]);
+
+      m_work = 0.0;
+      for (int j = 1; j <= q; j++)
+        {
+          double alpha = 1;
+          for (int m = 1; m <= q; m++)
+            if (m != j)
+              alpha *= (x[0] - x[m]) / (x[j] - x[m]);
+          alpha /= x[j] - x[0];
+          m_work += (-alpha / alpha0) * m_y[j-1];
+        }
+      m_ybar->set(m_work);
+      m_gamma->set(1 / alpha0);
+      return m_newton.trySolve(m_equ, y) == NewtonStatus::Converged;
+    }
+
+    // root mean square of (a-b) / (atol + rtol |a|)
+    double errorNorm (VectorView<double> a, VectorView<double> b, double rtol, double atol) const
+    {
+      double sum = 0;
+      for (size_t l = 0; l < m_n; l++)
+        {
+          double e = (a(l) - b(l)) / (atol + rtol * std::fabs(a(l)));
+          sum += e*e;
+        }
+      return std::sqrt(sum / m_n);
+    }
+
+    // start a new history at y unless y is its newest entry
+    void sync (VectorView<double> y)
+    {
+      if (m_y.size() > 0)
+        for (size_t l = 0; l < m_n; l++)
+          if (y(l) != m_y[0](l))
+            {
+              m_y.clear();
+              break;
+            }
+      if (m_y.size() == 0)
+        start(0, y);
+    }
+
+    void start (double t0, VectorView<double> y)
+    {
+      m_y.clear();
+      m_y.push(t0, y);
+      m_order = 1;
+      m_sameorder = 0;
+      m_tau = tauinit;
+    }
+
+    // first step size guess from the scaled sizes of y and f(y)
+    double initialStep (VectorView<double> y)
+    {
+      m_rhs->evaluate(y, m_work);
+      double d0 = 0, d1 = 0;
+      for (size_t l = 0; l < m_n; l++)
+        {
+          double w = 1 / (atol + rtol * std::fabs(y(l)));
+          d0 += y(l)*y(l) * w*w;
+          d1 += m_work(l)*m_work(l) * w*w;
+        }
+      return (d0 < 1e-10 || d1 < 1e-10) ? 1e-6 : 0.01 * std::sqrt(d0 / d1);
+    }
+
+    // error controlled steps from the newest history entry y to tend
+    void advance (double tend, VectorView<double> y,
+                  std::function<void(double,VectorView<double>)> callback)
+    {
+      double t0 = m_y.time(0), t = t0;
+      double tau = m_tau > 0 ? m_tau : initialStep(y);
+      tau = std::min(tau, tend-t0);
+
+      while (t < tend)
+        {
+          if (m_stats.accepted + m_stats.rejected >= maxsteps)
+            throw std::domain_error("BDF: too many steps");
+          if (tau < taumin * (tend-t0))
+            throw std::domain_error("BDF: step size too small");
+
+          bool last = t + 1.01 * tau >= tend;
+          if (last) tau = tend - t;
+
+          int q = m_order;
+          predict(tau, std::min<size_t>(m_y.size(), q+1), m_ypred);
+          m_ynew = m_ypred;
+          if (!solve(tau, q, m_ynew))
+            {
+              m_stats.rejected++;
+              tau *= 0.25;
+              continue;
+            }
+
+          double err = errorNorm(m_ynew, m_ypred, rtol, atol) / (q+1);
+          if (!(err <= 1))
+            {
+              m_stats.rejected++;
+              tau *= std::clamp(0.9 * std::pow(err, -1.0/(q+1)), 0.2, 0.9);
+              continue;
+            }
+
+          // step factors for the orders q-1, q, q+1; order changes after
+          // q+1 steps at constant order only
+          double fac = 0.9 * std::pow(std::max(err, 1e-10), -1.0/(q+1));
+          int newq = q;
+          if (++m_sameorder > q)
+            {
+              if (q > 1)
+                {
+                  predict(tau, q, m_work);
+                  double errm = errorNorm(m_ynew, m_work, rtol, atol) / q;
+                  double facm = 0.9 * std::pow(std::max(errm, 1e-10), -1.0/q);
+                  if (facm > fac) { fac = facm; newq = q-1; }
+                }
+              if (q < maxorder && m_y.size() >= size_t(q+2))
+                {
+                  predict(tau, q+2, m_work);
+                  double errp = errorNorm(m_ynew, m_work, rtol, atol) / (q+2);
+                  double facp = 0.9 * std::pow(std::max(errp, 1e-10), -1.0/(q+2));
+                  if (facp > fac) { fac = facp; newq = q+1; }
+                }
+              if (newq != q) m_sameorder = 0;
+            }
+
+          t = last ? tend : t + tau;
+          m_y.push(t, m_ynew);
+          y = m_ynew;
+          m_order = newq;
+          m_stats.accepted++;
+          if (callback) callback(t, y);
+
+          tau *= std::clamp(fac, 0.2, 5.0);
+        }
+      m_tau = m_stats.tau = tau;
+    }
+
+  public:
+    int maxorder = MaxOrder;
+    double rtol = 1e-6;
+    double atol = 1e-6;
+    double tauinit = 0;       // first step of integrate, 0 for an estimate from f(y0)
+    double taumin = 1e-12;    // relative to tend-t0
+    int maxsteps = 10000000;
+
+    BDF(std::shared_ptr<NonlinearFunction> rhs)
+      : TimeStepper(rhs), m_gamma(std::make_shared<Parameter>(0.0)),
+        m_n(rhs->dimX()), m_y(m_n, MaxOrder+1),
+        m_ypred(m_n), m_ynew(m_n), m_work(m_n)
+    {
+      m_ybar = std::make_shared<ConstantFunction>(m_n);
+      auto ynew = std::make_shared<IdentityFunction>(m_n);
+      m_equ = MakeExprFunction(Expr(ynew) - m_ybar - m_gamma * Expr(m_rhs));
+    }
+
+    // the next step starts a new history
+    void reset() { m_y.clear(); }
+
+    int order() const { return m_order; }
+    const AdaptiveStats & stats() const { return m_stats; }
+
+    // solver settings, e.g. the Jacobian refresh rule
+    Newton & newton() { return m_newton; }
+
+    void doStep(double tau, VectorView<double> y) override
+    {
+      beginStep(y);
+      stepWithHalving(tau, y);
+      endStep(tau, y);
+    }
+
+    bool tryStep(double tau, VectorView<double> y) override
+    {
+      sync(y);
+      // the startup builds the history with error controlled steps, so
+      // the low order of the first steps does not spoil the accuracy
+      if (m_y.size() <= size_t(maxorder))
+        {
+          advance(m_y.time(0)+tau, y, nullptr);
+          return true;
+        }
+      m_order = std::min<int>(maxorder, m_y.size());
+      predict(tau, std::min<size_t>(m_y.size(), m_order+1), y);
+      if (!solve(tau, m_order, y))
+        {
+          y = m_y[0];
+          return false;
+        }
+      m_y.push(m_y.time(0)+tau, y);
+      return true;
+    }
+
+    // from t0 to tend with step size and order chosen for rtol and atol,
+    // the callback is called after every accepted step
+    void integrate (double t0, double tend, VectorView<double> y,
+                    std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      m_stats = AdaptiveStats();
+      start(t0, y);
+      advance(tend, y, callback);
+    }
+  };
+
+}
+
+#endif
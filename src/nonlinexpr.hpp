@@ -0,0 +1,479 @@
+#ifndef NONLINEXPR_HPP
+#define NONLINEXPR_HPP
+
+#include <concepts>
+#include <type_traits>
+
+#include "nonlinfunc.hpp"
+
+/*
+  Statically typed counterpart of the NonlinearFunction graph.
+
+  The type of an expression like  Expr(ynew) - yold - tau * Expr(rhs)
+  encodes the whole tree, so evaluation is a single inlined kernel instead
+  of a chain of virtual calls. Every node accumulates fac * value into the
+  result, so linear combinations need no temporaries; only nonlinear leaves
+  and compositions keep a scratch buffer. The sparse Jacobian is assembled
+  the same way into a matrix whose pattern contains the pattern of the
+  expression. MakeExprFunction wraps an expression as an ordinary
+  NonlinearFunction.
+
+  Leaves of a model type declared final get their calls devirtualized.
+*/
+
+namespace ASC_ode
+{
+
+  template <typename T>
+  class ExprBase
+  {
+  public:
+    const T & derived() const { return static_cast<const T&>(*this); }
+  };
+
+  template <typename T>
+  concept IsExpr = std::derived_from<T, ExprBase<T>>;
+
+
+  class IdentityExpr : public ExprBase<IdentityExpr>
+  {
+    size_t m_n;
+  public:
+    IdentityExpr (size_t n) : m_n(n) { }
+    size_t dimX() const { return m_n; }
+    size_t dimF() const { return m_n; }
+    void addTo (VectorView<double> x, VectorView<double> f, double fac) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        f(i) += fac * x(i);
+    }
+    void addDerivTo (VectorView<double> x, MatrixView<double> df, double fac) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        df(i,i) += fac;
+    }
+    void addWithDerivTo (VectorView<double> x, VectorView<double> f, MatrixView<double> df, double fac) const
+    {
+      addTo(x, f, fac);
+      addDerivTo(x, df, fac);
+    }
+    void addJvTo (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      addTo(v, jv, fac);
+    }
+    bool hasPattern() const { return true; }
+    void addPattern (SparsityPattern & pattern) const { pattern.addDiag(0, m_n); }
+    void addDerivSparseTo (VectorView<double> x, SparseMatrix & df, double fac) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        df(i,i) += fac;
+    }
+    size_t version() const { return 0; }
+    bool isConstant() const { return false; }
+    bool isAffine() const { return true; }
+    size_t jacobianVersion() const { return 0; }
+    bool isThreadSafe() const { return true; }
+  };
+
+
+  class ConstantExpr : public ExprBase<ConstantExpr>
+  {
+    std::shared_ptr<ConstantFunction> m_c;
+  public:
+    ConstantExpr (std::shared_ptr<ConstantFunction> c) : m_c(c) { }
+    size_t dimX() const { return m_c->dimX(); }
+    size_t dimF() const { return m_c->dimF(); }
+    void addTo (VectorView<double> x, VectorView<double> f, double fac) const
+    {
+      auto val = m_c->get();
+      for (size_t i = 0; i < val.size(); i++)
+        f(i) += fac * val(i);
+    }
+    void addDerivTo (VectorView<double> x, MatrixView<double> df, double fac) const { }
+    void addWithDerivTo (VectorView<double> x, VectorView<double> f, MatrixView<double> df, double fac) const
+    {
+      addTo(x, f, fac);
+    }
+    void addJvTo (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const { }
+    bool hasPattern() const { return true; }
+    void addPattern (SparsityPattern & pattern) const { }
+    void addDerivSparseTo (VectorView<double> x, SparseMatrix & df, double fac) const { }
+    size_t version() const { return m_c->version(); }
+    bool isConstant() const { return true; }
+    bool isAffine() const { return true; }
+    size_t jacobianVersion() const { return 0; }
+    bool isThreadSafe() const { return true; }
+  };
+
+
+  // any NonlinearFunction as leaf
+  template <typename F>
+  class FuncExpr : public ExprBase<FuncExpr<F>>
+  {
+    std::shared_ptr<F> m_f;
+    mutable std::vector<double> m_tmpf, m_tmpdf;
+    // shared, so that the node stays copyable; built on first use
+    mutable std::shared_ptr<SparseMatrix> m_sparse;
+  public:
+    FuncExpr (std::shared_ptr<F> f) : m_f(f) { }
+    size_t dimX() const { return m_f->dimX(); }
+    size_t dimF() const { return m_f->dimF(); }
+    void addTo (VectorView<double> x, VectorView<double> f, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, dimF());
+      m_f->evaluate(x, tmp);
+      for (size_t i = 0; i < tmp.size(); i++)
+        f(i) += fac * tmp(i);
+    }
+    void addDerivTo (VectorView<double> x, MatrixView<double> df, double fac) const
+    {
+      auto tmp = ScratchMatrix(m_tmpdf, dimF(), dimX());
+      m_f->evaluateDeriv(x, tmp);
+      df += fac * tmp;
+    }
+    void addWithDerivTo (VectorView<double> x, VectorView<double> f, MatrixView<double> df, double fac) const
+    {
+      auto tmpf = ScratchVector(m_tmpf, dimF());
+      auto tmpdf = ScratchMatrix(m_tmpdf, dimF(), dimX());
+      m_f->evaluateWithDeriv(x, tmpf, tmpdf);
+      for (size_t i = 0; i < tmpf.size(); i++)
+        f(i) += fac * tmpf(i);
+      df += fac * tmpdf;
+    }
+    void addJvTo (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, dimF());
+      m_f->evaluateJv(x, v, tmp);
+      for (size_t i = 0; i < tmp.size(); i++)
+        jv(i) += fac * tmp(i);
+    }
+    bool hasPattern() const { return m_f->hasDerivPattern(); }
+    void addPattern (SparsityPattern & pattern) const { m_f->getDerivPattern(pattern); }
+    void addDerivSparseTo (VectorView<double> x, SparseMatrix & df, double fac) const
+    {
+      if (!m_sparse) m_sparse = std::make_shared<SparseMatrix>(m_f->derivPattern());
+      m_f->evaluateDerivSparse(x, *m_sparse);
+      df.addScaled(fac, *m_sparse);
+    }
+    size_t version() const { return m_f->version(); }
+    bool isConstant() const { return m_f->isConstant(); }
+    bool isAffine() const { return m_f->isAffine(); }
+    size_t jacobianVersion() const { return m_f->jacobianVersion(); }
+    bool isThreadSafe() const { return false; }
+  };
+
+
+  template <typename A, typename B>
+  class SumExpr : public ExprBase<SumExpr<A,B>>
+  {
+    A m_a;
+    B m_b;
+    double m_faca, m_facb;
+  public:
+    SumExpr (A a, B b, double faca, double facb)
+      : m_a(a), m_b(b), m_faca(faca), m_facb(facb) { }
+    size_t dimX() const { return m_a.dimX(); }
+    size_t dimF() const { return m_a.dimF(); }
+    void addTo (VectorView<double> x, VectorView<double> f, double fac) const
+    {
+      m_a.addTo(x, f, fac*m_faca);
+      m_b.addTo(x, f, fac*m_facb);
+    }
+    void addDerivTo (VectorView<double> x, MatrixView<double> df, double fac) const
+    {
+      m_a.addDerivTo(x, df, fac*m_faca);
+      m_b.addDerivTo(x, df, fac*m_facb);
+    }
+    void addWithDerivTo (VectorView<double> x, VectorView<double> f, MatrixView<double> df, double fac) const
+    {
+      m_a.addWithDerivTo(x, f, df, fac*m_faca);
+      m_b.addWithDerivTo(x, f, df, fac*m_facb);
+    }
+    void addJvTo (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      m_a.addJvTo(x, v, jv, fac*m_faca);
+      m_b.addJvTo(x, v, jv, fac*m_facb);
+    }
+    bool hasPattern() const { return m_a.hasPattern() && m_b.hasPattern(); }
+    void addPattern (SparsityPattern & pattern) const
+    {
+      m_a.addPattern(pattern);
+      m_b.addPattern(pattern);
+    }
+    void addDerivSparseTo (VectorView<double> x, SparseMatrix & df, double fac) const
+    {
+      m_a.addDerivSparseTo(x, df, fac*m_faca);
+      m_b.addDerivSparseTo(x, df, fac*m_facb);
+    }
+    size_t version() const { return m_a.version() + m_b.version(); }
+    bool isConstant() const { return m_a.isConstant() && m_b.isConstant(); }
+    bool isAffine() const { return m_a.isAffine() && m_b.isAffine(); }
+    size_t jacobianVersion() const { return m_a.jacobianVersion() + m_b.jacobianVersion(); }
+    bool isThreadSafe() const { return m_a.isThreadSafe() && m_b.isThreadSafe(); }
+  };
+
+
+  // scaling by a fixed number (S = double) or by a Parameter
+  template <typename A, typename S>
+  class ScaleExpr : public ExprBase<ScaleExpr<A,S>>
+  {
+    A m_a;
+    S m_fac;
+
+    double fac() const
+    {
+      if constexpr (std::is_same_v<S, double>) return m_fac;
+      else return m_fac->get();
+    }
+  public:
+    ScaleExpr (A a, S fac) : m_a(a), m_fac(fac) { }
+    size_t dimX() const { return m_a.dimX(); }
+    size_t dimF() const { return m_a.dimF(); }
+    void addTo (VectorView<double> x, VectorView<double> f, double fac) const
+    {
+      m_a.addTo(x, f, fac*this->fac());
+    }
+    void addDerivTo (VectorView<double> x, MatrixView<double> df, double fac) const
+    {
+      m_a.addDerivTo(x, df, fac*this->fac());
+    }
+    void addWithDerivTo (VectorView<double> x, VectorView<double> f, MatrixView<double> df, double fac) const
+    {
+      m_a.addWithDerivTo(x, f, df, fac*this->fac());
+    }
+    void addJvTo (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      m_a.addJvTo(x, v, jv, fac*this->fac());
+    }
+    bool hasPattern() const { return m_a.hasPattern(); }
+    void addPattern (SparsityPattern & pattern) const { m_a.addPattern(pattern); }
+    void addDerivSparseTo (VectorView<double> x, SparseMatrix & df, double fac) const
+    {
+      m_a.addDerivSparseTo(x, df, fac*this->fac());
+    }
+    size_t version() const
+    {
+      if constexpr (std::is_same_v<S, double>) return m_a.version();
+      else return m_a.version() + m_fac->version();
+    }
+    bool isConstant() const { return m_a.isConstant(); }
+    bool isAffine() const { return m_a.isAffine(); }
+    size_t jacobianVersion() const
+    {
+      if constexpr (std::is_same_v<S, double>) return m_a.jacobianVersion();
+      else return m_a.jacobianVersion() + m_fac->version();
+    }
+    bool isThreadSafe() const { return m_a.isThreadSafe(); }
+  };
+
+
+  // finalized pattern of the Jacobian of an expression
+  template <typename E>
+  SparsityPattern ExprPattern (const E & e)
+  {
+    SparsityPattern pattern(e.dimF(), e.dimX());
+    e.addPattern(pattern);
+    pattern.finalize();
+    return pattern;
+  }
+
+
+  // a(b)
+  template <typename A, typename B>
+  class ComposeExpr : public ExprBase<ComposeExpr<A,B>>
+  {
+    A m_a;
+    B m_b;
+    mutable std::vector<double> m_tmpf, m_tmpv, m_jaca, m_jacb, m_jacab;
+    mutable std::shared_ptr<SparseMatrix> m_sparsea, m_sparseb;
+  public:
+    ComposeExpr (A a, B b) : m_a(a), m_b(b) { }
+    size_t dimX() const { return m_b.dimX(); }
+    size_t dimF() const { return m_a.dimF(); }
+    void addTo (VectorView<double> x, VectorView<double> f, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, m_b.dimF());
+      tmp = 0.0;
+      m_b.addTo(x, tmp, 1);
+      m_a.addTo(tmp, f, fac);
+    }
+    void addDerivTo (VectorView<double> x, MatrixView<double> df, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, m_b.dimF());
+      tmp = 0.0;
+      m_b.addTo(x, tmp, 1);
+
+      auto jaca = ScratchMatrix(m_jaca, m_a.dimF(), m_a.dimX());
+      auto jacb = ScratchMatrix(m_jacb, m_b.dimF(), m_b.dimX());
+      auto jacab = ScratchMatrix(m_jacab, m_a.dimF(), m_b.dimX());
+      jaca = 0.0;
+      jacb = 0.0;
+      m_a.addDerivTo(tmp, jaca, 1);
+      m_b.addDerivTo(x, jacb, 1);
+      jacab = jaca*jacb;
+      df += fac * jacab;
+    }
+    void addWithDerivTo (VectorView<double> x, VectorView<double> f, MatrixView<double> df, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, m_b.dimF());
+      auto jaca = ScratchMatrix(m_jaca, m_a.dimF(), m_a.dimX());
+      auto jacb = ScratchMatrix(m_jacb, m_b.dimF(), m_b.dimX());
+      auto jacab = ScratchMatrix(m_jacab, m_a.dimF(), m_b.dimX());
+      tmp = 0.0;
+      jaca = 0.0;
+      jacb = 0.0;
+      m_b.addWithDerivTo(x, tmp, jacb, 1);
+      m_a.addWithDerivTo(tmp, f, jaca, fac);
+      jacab = jaca*jacb;
+      df += jacab;
+    }
+    void addJvTo (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, m_b.dimF());
+      auto tmpv = ScratchVector(m_tmpv, m_b.dimF());
+      tmp = 0.0;
+      tmpv = 0.0;
+      m_b.addTo(x, tmp, 1);
+      m_b.addJvTo(x, v, tmpv, 1);
+      m_a.addJvTo(tmp, tmpv, jv, fac);
+    }
+    bool hasPattern() const { return m_a.hasPattern() && m_b.hasPattern(); }
+    void addPattern (SparsityPattern & pattern) const
+    {
+      pattern.add(MultPattern(ExprPattern(m_a), ExprPattern(m_b)));
+    }
+    void addDerivSparseTo (VectorView<double> x, SparseMatrix & df, double fac) const
+    {
+      auto tmp = ScratchVector(m_tmpf, m_b.dimF());
+      tmp = 0.0;
+      m_b.addTo(x, tmp, 1);
+
+      if (!m_sparsea)
+        {
+          m_sparsea = std::make_shared<SparseMatrix>(ExprPattern(m_a));
+          m_sparseb = std::make_shared<SparseMatrix>(ExprPattern(m_b));
+        }
+      *m_sparsea = 0.0;
+      *m_sparseb = 0.0;
+      m_a.addDerivSparseTo(tmp, *m_sparsea, fac);
+      m_b.addDerivSparseTo(x, *m_sparseb, 1);
+      df.addMult(*m_sparsea, *m_sparseb);
+    }
+    size_t version() const { return m_a.version() + m_b.version(); }
+    bool isConstant() const { return m_b.isConstant(); }
+    bool isAffine() const { return m_b.isConstant() || (m_a.isAffine() && m_b.isAffine()); }
+    size_t jacobianVersion() const
+    {
+      if (m_b.isConstant()) return 0;
+      return m_a.jacobianVersion() + m_b.jacobianVersion();
+    }
+    bool isThreadSafe() const { return false; }
+  };
+
+
+
+  inline auto Expr (std::shared_ptr<IdentityFunction> f) { return IdentityExpr(f->dimX()); }
+  inline auto Expr (std::shared_ptr<ConstantFunction> f) { return ConstantExpr(f); }
+
+  template <typename F>
+  auto Expr (std::shared_ptr<F> f) { return FuncExpr<F>(f); }
+
+  template <IsExpr E>
+  auto Expr (const E & e) { return e; }
+
+  // one side of a mixed operator may be a plain function pointer
+  template <typename T>
+  concept ExprOperand = IsExpr<T> ||
+    requires (T f) { { Expr(f) } -> IsExpr; };
+
+  template <typename A, typename B>
+  concept ExprOperands = ExprOperand<A> && ExprOperand<B> && (IsExpr<A> || IsExpr<B>);
+
+
+  template <typename A, typename B> requires ExprOperands<A,B>
+  auto operator+ (const A & a, const B & b)
+  {
+    return SumExpr(Expr(a), Expr(b), 1, 1);
+  }
+
+  template <typename A, typename B> requires ExprOperands<A,B>
+  auto operator- (const A & a, const B & b)
+  {
+    return SumExpr(Expr(a), Expr(b), 1, -1);
+  }
+
+  template <IsExpr A>
+  auto operator* (double fac, const A & a)
+  {
+    return ScaleExpr<A,double>(a, fac);
+  }
+
+  template <IsExpr A>
+  auto operator* (std::shared_ptr<Parameter> fac, const A & a)
+  {
+    return ScaleExpr<A,std::shared_ptr<Parameter>>(a, fac);
+  }
+
+  template <typename A, typename B> requires ExprOperands<A,B>
+  auto Compose (const A & a, const B & b)
+  {
+    return ComposeExpr(Expr(a), Expr(b));
+  }
+
+
+
+  template <IsExpr E>
+  class ExprFunction : public NonlinearFunction
+  {
+    E m_expr;
+  public:
+    ExprFunction (E expr) : m_expr(expr) { }
+    size_t dimX() const override { return m_expr.dimX(); }
+    size_t dimF() const override { return m_expr.dimF(); }
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      f = 0.0;
+      m_expr.addTo(x, f, 1);
+    }
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      df = 0.0;
+      m_expr.addDerivTo(x, df, 1);
+    }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      f = 0.0;
+      df = 0.0;
+      m_expr.addWithDerivTo(x, f, df, 1);
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+      m_expr.addJvTo(x, v, jv, 1);
+    }
+    bool hasDerivPattern() const override { return m_expr.hasPattern(); }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      m_expr.addPattern(pattern);
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      m_expr.addDerivSparseTo(x, df, 1);
+    }
+    size_t version() const override { return m_expr.version(); }
+    bool isConstant() const override { return m_expr.isConstant(); }
+    bool isAffine() const override { return m_expr.isAffine(); }
+    size_t jacobianVersion() const override { return m_expr.jacobianVersion(); }
+    bool isThreadSafe() const override { return m_expr.isThreadSafe(); }
+  };
+
+  template <IsExpr E>
+  auto MakeExprFunction (const E & expr)
+  {
+    return std::make_shared<ExprFunction<E>>(expr);
+  }
+
+}
+
+#endif
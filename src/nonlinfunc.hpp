@@ -1,16 +1,33 @@
 #ifndef NONLINFUNC_H
 #define NONLINFUNC_H
 
+#include <cmath>
 #include <cstddef>
 #include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include <vector.hpp>
 #include <matrix.hpp>
 
+#include "sparsematrix.hpp"
+#include "threadpool.hpp"
+
 namespace ASC_ode
 {
   using namespace nanoblas;
 
+  class NonlinearFunction;
+  class Parameter;
+
+  // fac * params[0] * params[1] * ... * func, see NonlinearFunction::linearTerms
+  struct LinearTerm
+  {
+    double fac;
+    std::vector<std::shared_ptr<Parameter>> params;
+    std::shared_ptr<NonlinearFunction> func;
+  };
+
   class NonlinearFunction
   {
   public:
@@ -19,9 +36,130 @@ namespace ASC_ode
     virtual size_t dimF() const = 0;
     virtual void evaluate (VectorView<double> x, VectorView<double> f) const = 0;
     virtual void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const = 0;
+
+    // value and Jacobian at the same x in one call, so that intermediate
+    // results can be shared
+    virtual void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const
+    {
+      evaluate(x, f);
+      evaluateDeriv(x, df);
+    }
+
+    // Sparse Jacobian: the pattern is queried once, evaluateDerivSparse then
+    // fills a matrix whose pattern contains it. The defaults are dense.
+    // Functions overriding getDerivPattern say so by hasDerivPattern.
+    virtual bool hasDerivPattern() const { return false; }
+
+    virtual void getDerivPattern (SparsityPattern & pattern) const
+    {
+      pattern.addBlock(0, dimF(), 0, dimX());
+    }
+
+    virtual void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const
+    {
+      Matrix<double> dense(dimF(), dimX());
+      evaluateDeriv(x, dense);
+      df.setFromDense(dense);
+    }
+
+    // directional derivative jv = df(x) v, by default a central difference
+    virtual void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const
+    {
+      double nv = norm(v);
+      if (nv == 0)
+        {
+          jv = 0.0;
+          return;
+        }
+      double eps = 1e-8 * (1+norm(x)) / nv;
+      Vector<> xe(dimX()), fe(dimF());
+      xe = x + eps*v;
+      evaluate(xe, jv);
+      xe = x - eps*v;
+      evaluate(xe, fe);
+      jv -= fe;
+      jv *= 1.0 / (2*eps);
+    }
+
+    // Batched evaluation of independent states in structure-of-arrays layout:
+    // column j of x (dimX() x N) is the j-th state, column j of f its value.
+    // The default evaluates column by column.
+    virtual void evaluateBatch (MatrixView<double> x, MatrixView<double> f) const
+    {
+      Vector<> xj(dimX()), fj(dimF());
+      for (size_t j = 0; j < x.cols(); j++)
+        {
+          xj = x.col(j);
+          evaluate(xj, fj);
+          f.col(j) = fj;
+        }
+    }
+
+    // Nodes that are linear combinations of other nodes append these as
+    // terms and return true; used for rewriting graphs, see Simplify.
+    virtual bool linearTerms (std::vector<LinearTerm> & terms) const { return false; }
+
+    // Counter that changes whenever a ConstantFunction or Parameter this
+    // function depends on is set; used to invalidate cached values
+    virtual size_t version() const { return 0; }
+
+    // true if the value does not depend on x
+    virtual bool isConstant() const { return false; }
+
+    // true if f(x) = A x + b, i.e. the Jacobian does not depend on x
+    virtual bool isAffine() const { return false; }
+
+    // for affine functions: counter that changes whenever the Jacobian
+    // changes, e.g. by a Parameter::set
+    virtual size_t jacobianVersion() const { return version(); }
+
+    // true if evaluate, evaluateDeriv and evaluateWithDeriv may run
+    // concurrently on different x, i.e. they use no shared scratch memory
+    virtual bool isThreadSafe() const { return false; }
+
+    // bandwidth of the Jacobian, a banded model can advertise it without
+    // building the pattern. Without a pattern the Jacobian counts as full.
+    virtual Bandwidth bandwidth() const
+    {
+      if (!hasDerivPattern())
+        return { dimF() ? dimF()-1 : 0, dimX() ? dimX()-1 : 0 };
+      return derivPattern().bandwidth();
+    }
+
+    SparsityPattern derivPattern() const
+    {
+      SparsityPattern pattern(dimF(), dimX());
+      getDerivPattern(pattern);
+      pattern.finalize();
+      return pattern;
+    }
   };
 
 
+  // Scratch storage for intermediate results of a node. The buffer grows on
+  // first use and is reused afterwards, so evaluating a built graph does not
+  // allocate in steady state. A node holding scratch must not be evaluated
+  // concurrently from several threads.
+  inline VectorView<double> ScratchVector (std::vector<double> & buf, size_t n)
+  {
+    if (buf.size() < n) buf.resize(n);
+    return VectorView<double>(n, buf.data());
+  }
+
+  inline MatrixView<double> ScratchMatrix (std::vector<double> & buf, size_t h, size_t w)
+  {
+    if (buf.size() < h*w) buf.resize(h*w);
+    return MatrixView<double>(h, w, w, buf.data());
+  }
+
+  // sparse Jacobian of func, with its pattern built on first use
+  inline SparseMatrix & ScratchSparse (std::unique_ptr<SparseMatrix> & buf, const NonlinearFunction & func)
+  {
+    if (!buf) buf = std::make_unique<SparseMatrix>(func.derivPattern());
+    return *buf;
+  }
+
+
   class IdentityFunction : public NonlinearFunction
   {
     size_t m_n;
@@ -29,6 +167,9 @@ namespace ASC_ode
     IdentityFunction (size_t n) : m_n(n) { } 
     size_t dimX() const override { return m_n; }
     size_t dimF() const override { return m_n; }
+    bool isThreadSafe() const override { return true; }
+    bool isAffine() const override { return true; }
+    size_t jacobianVersion() const override { return 0; }
     void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       f = x;
@@ -39,20 +180,44 @@ namespace ASC_ode
       df = 0.0;
       df.diag() = 1.0;
     }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      f = x;
+      df = 0.0;
+      df.diag() = 1.0;
+    }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      pattern.addDiag(0, m_n);
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < m_n; i++)
+        df(i,i) = 1.0;
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = v;
+    }
   };
 
 
 
+  // Change the value with set(), which also invalidates caches depending on it
   class ConstantFunction : public NonlinearFunction
   {
     Vector<> m_val;
+    size_t m_version = 0;
   public:
     ConstantFunction(size_t n) : m_val(n) { }
     ConstantFunction(VectorView<double> val) : m_val(val) { }
-    void set(VectorView<double> val) { m_val = val; }
+    void set(VectorView<double> val) { m_val = val; m_version++; }
     VectorView<double> get() const { return m_val; }
     size_t dimX() const override { return m_val.size(); }
     size_t dimF() const override { return m_val.size(); }
+    bool isThreadSafe() const override { return true; }
     void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       f = m_val;
@@ -61,6 +226,25 @@ namespace ASC_ode
     {
       df = 0.0;
     }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      f = m_val;
+      df = 0.0;
+    }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern (SparsityPattern & pattern) const override { }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+    }
+    size_t version() const override { return m_version; }
+    bool isConstant() const override { return true; }
+    bool isAffine() const override { return true; }
+    size_t jacobianVersion() const override { return 0; }
   };
 
   
@@ -69,6 +253,8 @@ namespace ASC_ode
   {
     std::shared_ptr<NonlinearFunction> m_fa, m_fb;
     double m_faca, m_facb;
+    mutable std::vector<double> m_tmpf, m_tmpdf;
+    mutable std::unique_ptr<SparseMatrix> m_sparseb;
   public:
     SumFunction (std::shared_ptr<NonlinearFunction> fa,
                  std::shared_ptr<NonlinearFunction> fb,
@@ -81,7 +267,7 @@ namespace ASC_ode
     {
       m_fa->evaluate(x, f);
       f *= m_faca;
-      Vector<> tmp(dimF());
+      auto tmp = ScratchVector(m_tmpf, dimF());
       m_fb->evaluate(x, tmp);
       f += m_facb*tmp;
     }
@@ -89,10 +275,53 @@ namespace ASC_ode
     {
       m_fa->evaluateDeriv(x, df);
       df *= m_faca;
-      Matrix<double> tmp(dimF(), dimX());
+      auto tmp = ScratchMatrix(m_tmpdf, dimF(), dimX());
       m_fb->evaluateDeriv(x, tmp);
       df += m_facb*tmp;
     }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      m_fa->evaluateWithDeriv(x, f, df);
+      f *= m_faca;
+      df *= m_faca;
+      auto tmpf = ScratchVector(m_tmpf, dimF());
+      auto tmpdf = ScratchMatrix(m_tmpdf, dimF(), dimX());
+      m_fb->evaluateWithDeriv(x, tmpf, tmpdf);
+      f += m_facb*tmpf;
+      df += m_facb*tmpdf;
+    }
+    bool hasDerivPattern() const override { return m_fa->hasDerivPattern() && m_fb->hasDerivPattern(); }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      m_fa->getDerivPattern(pattern);
+      m_fb->getDerivPattern(pattern);
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      m_fa->evaluateDerivSparse(x, df);
+      df *= m_faca;
+      auto & tmp = ScratchSparse(m_sparseb, *m_fb);
+      m_fb->evaluateDerivSparse(x, tmp);
+      df.addScaled(m_facb, tmp);
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      m_fa->evaluateJv(x, v, jv);
+      jv *= m_faca;
+      auto tmp = ScratchVector(m_tmpf, dimF());
+      m_fb->evaluateJv(x, v, tmp);
+      jv += m_facb*tmp;
+    }
+    bool linearTerms (std::vector<LinearTerm> & terms) const override
+    {
+      terms.push_back({m_faca, {}, m_fa});
+      terms.push_back({m_facb, {}, m_fb});
+      return true;
+    }
+    size_t version() const override { return m_fa->version() + m_fb->version(); }
+    bool isConstant() const override { return m_fa->isConstant() && m_fb->isConstant(); }
+    bool isAffine() const override { return m_fa->isAffine() && m_fb->isAffine(); }
+    size_t jacobianVersion() const override { return m_fa->jacobianVersion() + m_fb->jacobianVersion(); }
   };
 
 
@@ -109,10 +338,17 @@ namespace ASC_ode
   class Parameter 
   {
     double m_value;
+    size_t m_version = 0;
   public:
     Parameter(double value) : m_value(value) {}
     double get() const { return m_value; }
-    void set(double value) { m_value = value; }
+    void set(double value)
+    {
+      if (value == m_value) return;
+      m_value = value;
+      m_version++;
+    }
+    size_t version() const { return m_version; }
   };
 
   class ScaleFunction : public NonlinearFunction
@@ -126,6 +362,7 @@ namespace ASC_ode
 
     size_t dimX() const override { return m_fa->dimX(); }
     size_t dimF() const override { return m_fa->dimF(); }
+    bool isThreadSafe() const override { return m_fa->isThreadSafe(); }
     void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       m_fa->evaluate(x, f);
@@ -137,6 +374,36 @@ namespace ASC_ode
       m_fa->evaluateDeriv(x, df);
       df *= m_fac->get();
     }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      m_fa->evaluateWithDeriv(x, f, df);
+      f *= m_fac->get();
+      df *= m_fac->get();
+    }
+    bool hasDerivPattern() const override { return m_fa->hasDerivPattern(); }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      m_fa->getDerivPattern(pattern);
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      m_fa->evaluateDerivSparse(x, df);
+      df *= m_fac->get();
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      m_fa->evaluateJv(x, v, jv);
+      jv *= m_fac->get();
+    }
+    bool linearTerms (std::vector<LinearTerm> & terms) const override
+    {
+      terms.push_back({1, {m_fac}, m_fa});
+      return true;
+    }
+    size_t version() const override { return m_fa->version() + m_fac->version(); }
+    bool isConstant() const override { return m_fa->isConstant(); }
+    bool isAffine() const override { return m_fa->isAffine(); }
+    size_t jacobianVersion() const override { return m_fa->jacobianVersion() + m_fac->version(); }
   };
 
   inline auto operator* (std::shared_ptr<Parameter> parama, 
@@ -157,32 +424,85 @@ namespace ASC_ode
   class ComposeFunction : public NonlinearFunction
   {
     std::shared_ptr<NonlinearFunction> m_fa, m_fb;
+    mutable std::vector<double> m_tmpf, m_tmpv, m_jaca, m_jacb;
+    mutable std::unique_ptr<SparseMatrix> m_sparsea, m_sparseb;
   public:
     ComposeFunction (std::shared_ptr<NonlinearFunction> fa,
                      std::shared_ptr<NonlinearFunction> fb)
       : m_fa(fa), m_fb(fb) { }
 
+    auto outer() const { return m_fa; }
+    auto inner() const { return m_fb; }
+
     size_t dimX() const override { return m_fb->dimX(); }
     size_t dimF() const override { return m_fa->dimF(); }
     void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
-      Vector<> tmp(m_fb->dimF());
+      auto tmp = ScratchVector(m_tmpf, m_fb->dimF());
       m_fb->evaluate (x, tmp);
       m_fa->evaluate (tmp, f);
     }
     void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
     {
-      Vector<> tmp(m_fb->dimF());
+      auto tmp = ScratchVector(m_tmpf, m_fb->dimF());
       m_fb->evaluate (x, tmp);
 
-      Matrix<double> jaca(m_fa->dimF(), m_fa->dimX());
-      Matrix<double> jacb(m_fb->dimF(), m_fb->dimX());
+      auto jaca = ScratchMatrix(m_jaca, m_fa->dimF(), m_fa->dimX());
+      auto jacb = ScratchMatrix(m_jacb, m_fb->dimF(), m_fb->dimX());
 
       m_fb->evaluateDeriv(x, jacb);
       m_fa->evaluateDeriv(tmp, jaca);
 
       df = jaca*jacb;
     }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      auto tmp = ScratchVector(m_tmpf, m_fb->dimF());
+      auto jaca = ScratchMatrix(m_jaca, m_fa->dimF(), m_fa->dimX());
+      auto jacb = ScratchMatrix(m_jacb, m_fb->dimF(), m_fb->dimX());
+
+      m_fb->evaluateWithDeriv(x, tmp, jacb);
+      m_fa->evaluateWithDeriv(tmp, f, jaca);
+
+      df = jaca*jacb;
+    }
+    bool hasDerivPattern() const override { return m_fa->hasDerivPattern() && m_fb->hasDerivPattern(); }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      pattern.add(MultPattern(m_fa->derivPattern(), m_fb->derivPattern()));
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      auto tmp = ScratchVector(m_tmpf, m_fb->dimF());
+      m_fb->evaluate (x, tmp);
+
+      auto & jaca = ScratchSparse(m_sparsea, *m_fa);
+      auto & jacb = ScratchSparse(m_sparseb, *m_fb);
+      m_fb->evaluateDerivSparse(x, jacb);
+      m_fa->evaluateDerivSparse(tmp, jaca);
+
+      df = 0.0;
+      df.addMult(jaca, jacb);
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      auto tmp = ScratchVector(m_tmpf, m_fb->dimF());
+      auto tmpv = ScratchVector(m_tmpv, m_fb->dimF());
+      m_fb->evaluate (x, tmp);
+      m_fb->evaluateJv (x, v, tmpv);
+      m_fa->evaluateJv (tmp, tmpv, jv);
+    }
+    size_t version() const override { return m_fa->version() + m_fb->version(); }
+    bool isConstant() const override { return m_fb->isConstant(); }
+    bool isAffine() const override
+    {
+      return m_fb->isConstant() || (m_fa->isAffine() && m_fb->isAffine());
+    }
+    size_t jacobianVersion() const override
+    {
+      if (m_fb->isConstant()) return 0;
+      return m_fa->jacobianVersion() + m_fb->jacobianVersion();
+    }
   };
   
   
@@ -196,6 +516,7 @@ namespace ASC_ode
     std::shared_ptr<NonlinearFunction> m_fa;
     size_t m_firstx, m_dimx, m_firstf, m_dimf;
     size_t m_nextx, m_nextf;
+    mutable std::unique_ptr<SparseMatrix> m_sparsea;
   public:
     EmbedFunction (std::shared_ptr<NonlinearFunction> fa,
                    size_t firstx, size_t dimx,
@@ -207,6 +528,7 @@ namespace ASC_ode
 
     size_t dimX() const override { return m_dimx; }
     size_t dimF() const override { return m_dimf; }
+    bool isThreadSafe() const override { return m_fa->isThreadSafe(); }
     void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       f = 0.0;
@@ -218,6 +540,35 @@ namespace ASC_ode
       m_fa->evaluateDeriv(x.range(m_firstx, m_nextx),
                         df.rows(m_firstf, m_nextf).cols(m_firstx, m_nextx));
     }
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      f = 0.0;
+      df = 0;
+      m_fa->evaluateWithDeriv(x.range(m_firstx, m_nextx), f.range(m_firstf, m_nextf),
+                              df.rows(m_firstf, m_nextf).cols(m_firstx, m_nextx));
+    }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      pattern.add(m_fa->derivPattern(), m_firstf, m_firstx);
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      auto & jaca = ScratchSparse(m_sparsea, *m_fa);
+      m_fa->evaluateDerivSparse(x.range(m_firstx, m_nextx), jaca);
+      df = 0.0;
+      df.addScaled(1, jaca, m_firstf, m_firstx);
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+      m_fa->evaluateJv(x.range(m_firstx, m_nextx), v.range(m_firstx, m_nextx),
+                       jv.range(m_firstf, m_nextf));
+    }
+    size_t version() const override { return m_fa->version(); }
+    bool isConstant() const override { return m_fa->isConstant(); }
+    bool isAffine() const override { return m_fa->isAffine(); }
+    size_t jacobianVersion() const override { return m_fa->jacobianVersion(); }
   };
 
   
@@ -231,6 +582,9 @@ namespace ASC_ode
 
     size_t dimX() const override { return m_size; }
     size_t dimF() const override { return m_size; }
+    bool isThreadSafe() const override { return true; }
+    bool isAffine() const override { return true; }
+    size_t jacobianVersion() const override { return 0; }
     void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       f = 0.0;
@@ -241,6 +595,22 @@ namespace ASC_ode
       df = 0.0;
       df.diag().range(m_first, m_next) = 1;
     }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      pattern.addDiag(m_first, m_next);
+    }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = m_first; i < m_next; i++)
+        df(i,i) = 1.0;
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+      jv.range(m_first, m_next) = v.range(m_first, m_next);
+    }
   };
 
   
@@ -248,6 +618,19 @@ namespace ASC_ode
   {
     std::shared_ptr<NonlinearFunction> func;
     size_t num, fdimx, fdimf;
+    mutable std::unique_ptr<SparseMatrix> m_sparsef;
+
+    // the blocks are independent, run them on the thread pool if func
+    // allows and the blocks are not too small
+    template <typename FUNC>
+    void forEachBlock (FUNC blockfunc) const
+    {
+      if (func->isThreadSafe() && fdimx >= ParallelMinDim)
+        DefaultThreadPool().parallelFor(num, [&](size_t i, size_t) { blockfunc(i); });
+      else
+        for (size_t i = 0; i < num; i++)
+          blockfunc(i);
+    }
   public:
     MultipleFunc (std::shared_ptr<NonlinearFunction> _func, int _num)
       : func(_func), num(_num)
@@ -258,19 +641,62 @@ namespace ASC_ode
 
     virtual size_t dimX() const override { return num * fdimx; } 
     virtual size_t dimF() const override{ return num * fdimf; }
+    virtual bool isThreadSafe() const override { return func->isThreadSafe(); }
     virtual void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
-      for (size_t i = 0; i < num; i++)
+      forEachBlock([&](size_t i)
+      {
         func->evaluate(x.range(i*fdimx, (i+1)*fdimx),
                        f.range(i*fdimf, (i+1)*fdimf));
+      });
     }
     virtual void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
     {
       df = 0.0;
-      for (size_t i = 0; i < num; i++)
+      forEachBlock([&](size_t i)
+      {
         func->evaluateDeriv(x.range(i*fdimx, (i+1)*fdimx),
                             df.rows(i*fdimf, (i+1)*fdimf).cols(i*fdimx, (i+1)*fdimx));
+      });
     }
+    virtual void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      df = 0.0;
+      forEachBlock([&](size_t i)
+      {
+        func->evaluateWithDeriv(x.range(i*fdimx, (i+1)*fdimx),
+                                f.range(i*fdimf, (i+1)*fdimf),
+                                df.rows(i*fdimf, (i+1)*fdimf).cols(i*fdimx, (i+1)*fdimx));
+      });
+    }
+    virtual bool hasDerivPattern() const override { return true; }
+    virtual void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      auto fpattern = func->derivPattern();
+      for (size_t i = 0; i < num; i++)
+        pattern.add(fpattern, i*fdimf, i*fdimx);
+    }
+    virtual void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      auto & jacf = ScratchSparse(m_sparsef, *func);
+      df = 0.0;
+      for (size_t i = 0; i < num; i++)
+        {
+          func->evaluateDerivSparse(x.range(i*fdimx, (i+1)*fdimx), jacf);
+          df.addScaled(1, jacf, i*fdimf, i*fdimx);
+        }
+    }
+    virtual void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      for (size_t i = 0; i < num; i++)
+        func->evaluateJv(x.range(i*fdimx, (i+1)*fdimx),
+                         v.range(i*fdimx, (i+1)*fdimx),
+                         jv.range(i*fdimf, (i+1)*fdimf));
+    }
+    virtual size_t version() const override { return func->version(); }
+    virtual bool isConstant() const override { return func->isConstant(); }
+    virtual bool isAffine() const override { return func->isAffine(); }
+    virtual size_t jacobianVersion() const override { return func->jacobianVersion(); }
   };
 
 
@@ -284,6 +710,9 @@ namespace ASC_ode
 
     virtual size_t dimX() const override { return m_n*m_a.rows(); } 
     virtual size_t dimF() const override { return m_n*m_a.cols(); }
+    virtual bool isThreadSafe() const override { return true; }
+    virtual bool isAffine() const override { return true; }
+    virtual size_t jacobianVersion() const override { return 0; }
     virtual void evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       MatrixView<double> mx(m_a.cols(), m_n, m_n, x.data());
@@ -297,6 +726,77 @@ namespace ASC_ode
         for (size_t j = 0; j < m_a.cols(); j++)
           df.rows(i*m_n, (i+1)*m_n).cols(j*m_n, (j+1)*m_n).diag() = m_a(i,j);
     }
+    virtual bool hasDerivPattern() const override { return true; }
+    virtual void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      for (size_t i = 0; i < m_a.rows(); i++)
+        for (size_t j = 0; j < m_a.cols(); j++)
+          if (m_a(i,j) != 0)
+            pattern.addDiag(0, m_n, i*m_n, j*m_n);
+    }
+    virtual void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < m_a.rows(); i++)
+        for (size_t j = 0; j < m_a.cols(); j++)
+          if (m_a(i,j) != 0)
+            for (size_t k = 0; k < m_n; k++)
+              df(i*m_n+k, j*m_n+k) = m_a(i,j);
+    }
+    virtual void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      evaluate(v, jv);
+    }
+  };
+
+
+  // Memoizes an x-independent subgraph such as rhs(yold) in Crank-Nicolson.
+  // The value is recomputed only after a ConstantFunction or Parameter below
+  // it was set; the derivative with respect to x is identically zero.
+  class CachedFunction : public NonlinearFunction
+  {
+    std::shared_ptr<NonlinearFunction> m_func;
+    mutable Vector<> m_val;
+    mutable size_t m_version = 0;
+    mutable bool m_valid = false;
+  public:
+    CachedFunction (std::shared_ptr<NonlinearFunction> func)
+      : m_func(func), m_val(func->dimF())
+    {
+      if (!func->isConstant())
+        throw std::invalid_argument("CachedFunction: function depends on x");
+    }
+
+    size_t dimX() const override { return m_func->dimX(); }
+    size_t dimF() const override { return m_func->dimF(); }
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      if (!m_valid || m_version != m_func->version())
+        {
+          m_func->evaluate(x, m_val);
+          m_version = m_func->version();
+          m_valid = true;
+        }
+      f = m_val;
+    }
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      df = 0.0;
+    }
+    bool hasDerivPattern() const override { return true; }
+    void getDerivPattern (SparsityPattern & pattern) const override { }
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+    }
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+    }
+    size_t version() const override { return m_func->version(); }
+    bool isConstant() const override { return true; }
+    bool isAffine() const override { return true; }
+    size_t jacobianVersion() const override { return 0; }
   };
 
 }
@@ -13,6 +13,7 @@ public:
 
     size_t dimX() const override { return 2; }
     size_t dimF() const override { return 2; }
+    bool isThreadSafe() const override { return true; }
 
     // x(0) = U_C (capacitor voltage)
     // x(1) = t   (time variable)
@@ -30,6 +31,15 @@ public:
         df(0,0) = -1.0/(R*C);
         df(0,1) = (-100.0*M_PI * std::sin(100.0 * M_PI * x(1))) / (R*C);
     }
+
+    // columns are independent circuits
+    void evaluateBatch(MatrixView<double> x, MatrixView<double> f) const override {
+        double fac = 1.0 / (R*C);
+        for (size_t j = 0; j < x.cols(); j++) {
+            f(0,j) = (std::cos(100.0 * M_PI * x(1,j)) - x(0,j)) * fac;
+            f(1,j) = 1.0;
+        }
+    }
 };
 
 }
@@ -0,0 +1,314 @@
+#ifndef SIMPLIFY_HPP
+#define SIMPLIFY_HPP
+
+#include <algorithm>
+
+#include "nonlinfunc.hpp"
+
+namespace ASC_ode
+{
+
+  // Flat linear combination  sum_i c_i f_i(x). Every coefficient is a number
+  // times a product of Parameters, evaluated when the function is called.
+  // Identity terms are merged into one diagonal, constant terms are added
+  // without being evaluated and do not touch the Jacobian.
+  class LinearCombinationFunction : public NonlinearFunction
+  {
+    std::vector<LinearTerm> m_ident, m_const, m_general;
+    size_t m_dimx, m_dimf;
+    mutable std::vector<double> m_tmpf, m_tmpdf;
+    mutable std::vector<std::unique_ptr<SparseMatrix>> m_sparse;
+
+    static double coef (const LinearTerm & term)
+    {
+      double c = term.fac;
+      for (auto & p : term.params)
+        c *= p->get();
+      return c;
+    }
+
+    double identCoef() const
+    {
+      double c = 0;
+      for (auto & t : m_ident)
+        c += coef(t);
+      return c;
+    }
+
+  public:
+    LinearCombinationFunction (const std::vector<LinearTerm> & terms)
+      : m_dimx(terms[0].func->dimX()), m_dimf(terms[0].func->dimF())
+    {
+      for (auto & t : terms)
+        if (dynamic_cast<IdentityFunction*>(t.func.get()))
+          m_ident.push_back(t);
+        else if (dynamic_cast<ConstantFunction*>(t.func.get()))
+          m_const.push_back(t);
+        else
+          m_general.push_back(t);
+      m_sparse.resize(m_general.size());
+    }
+
+    size_t dimX() const override { return m_dimx; }
+    size_t dimF() const override { return m_dimf; }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      if (m_ident.empty())
+        f = 0.0;
+      else
+        f = identCoef() * x;
+
+      for (auto & t : m_const)
+        f += coef(t) * static_cast<ConstantFunction&>(*t.func).get();
+
+      if (m_general.empty()) return;
+      auto tmp = ScratchVector(m_tmpf, m_dimf);
+      for (auto & t : m_general)
+        {
+          t.func->evaluate(x, tmp);
+          f += coef(t) * tmp;
+        }
+    }
+
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      if (m_general.empty())
+        df = 0.0;
+      else
+        {
+          m_general[0].func->evaluateDeriv(x, df);
+          df *= coef(m_general[0]);
+          if (m_general.size() > 1)
+            {
+              auto tmp = ScratchMatrix(m_tmpdf, m_dimf, m_dimx);
+              for (size_t i = 1; i < m_general.size(); i++)
+                {
+                  m_general[i].func->evaluateDeriv(x, tmp);
+                  df += coef(m_general[i]) * tmp;
+                }
+            }
+        }
+
+      if (!m_ident.empty())
+        {
+          double c = identCoef();
+          for (size_t i = 0; i < m_dimf; i++)
+            df(i,i) += c;
+        }
+    }
+
+    void evaluateWithDeriv (VectorView<double> x, VectorView<double> f, MatrixView<double> df) const override
+    {
+      double c = identCoef();
+      if (m_ident.empty())
+        f = 0.0;
+      else
+        f = c * x;
+
+      for (auto & t : m_const)
+        f += coef(t) * static_cast<ConstantFunction&>(*t.func).get();
+
+      if (m_general.empty())
+        df = 0.0;
+      else
+        {
+          auto tmpf = ScratchVector(m_tmpf, m_dimf);
+          auto tmpdf = ScratchMatrix(m_tmpdf, m_dimf, m_dimx);
+          for (size_t i = 0; i < m_general.size(); i++)
+            {
+              double ci = coef(m_general[i]);
+              if (i == 0)
+                {
+                  m_general[0].func->evaluateWithDeriv(x, tmpf, df);
+                  df *= ci;
+                }
+              else
+                {
+                  m_general[i].func->evaluateWithDeriv(x, tmpf, tmpdf);
+                  df += ci * tmpdf;
+                }
+              f += ci * tmpf;
+            }
+        }
+
+      if (!m_ident.empty())
+        for (size_t i = 0; i < m_dimf; i++)
+          df(i,i) += c;
+    }
+
+    bool hasDerivPattern() const override
+    {
+      for (auto & t : m_general)
+        if (!t.func->hasDerivPattern()) return false;
+      return true;
+    }
+
+    void getDerivPattern (SparsityPattern & pattern) const override
+    {
+      if (!m_ident.empty())
+        pattern.addDiag(0, m_dimf);
+      for (auto & t : m_general)
+        t.func->getDerivPattern(pattern);
+    }
+
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < m_general.size(); i++)
+        {
+          auto & tmp = ScratchSparse(m_sparse[i], *m_general[i].func);
+          m_general[i].func->evaluateDerivSparse(x, tmp);
+          df.addScaled(coef(m_general[i]), tmp);
+        }
+      if (!m_ident.empty())
+        {
+          double c = identCoef();
+          for (size_t i = 0; i < m_dimf; i++)
+            df(i,i) += c;
+        }
+    }
+
+    void evaluateJv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      if (m_ident.empty())
+        jv = 0.0;
+      else
+        jv = identCoef() * v;
+
+      if (m_general.empty()) return;
+      auto tmp = ScratchVector(m_tmpf, m_dimf);
+      for (auto & t : m_general)
+        {
+          t.func->evaluateJv(x, v, tmp);
+          jv += coef(t) * tmp;
+        }
+    }
+
+    bool linearTerms (std::vector<LinearTerm> & terms) const override
+    {
+      terms.insert(terms.end(), m_ident.begin(), m_ident.end());
+      terms.insert(terms.end(), m_const.begin(), m_const.end());
+      terms.insert(terms.end(), m_general.begin(), m_general.end());
+      return true;
+    }
+
+    size_t version() const override
+    {
+      size_t sum = 0;
+      for (auto * terms : { &m_ident, &m_const, &m_general })
+        for (auto & t : *terms)
+          {
+            sum += t.func->version();
+            for (auto & p : t.params)
+              sum += p->version();
+          }
+      return sum;
+    }
+
+    bool isConstant() const override
+    {
+      return m_ident.empty() &&
+        std::all_of(m_general.begin(), m_general.end(),
+                    [](const LinearTerm & t) { return t.func->isConstant(); });
+    }
+
+    bool isAffine() const override
+    {
+      return std::all_of(m_general.begin(), m_general.end(),
+                         [](const LinearTerm & t) { return t.func->isAffine(); });
+    }
+
+    // constant terms do not contribute to the Jacobian
+    size_t jacobianVersion() const override
+    {
+      size_t sum = 0;
+      for (auto & t : m_ident)
+        for (auto & p : t.params)
+          sum += p->version();
+      for (auto & t : m_general)
+        {
+          sum += t.func->jacobianVersion();
+          for (auto & p : t.params)
+            sum += p->version();
+        }
+      return sum;
+    }
+  };
+
+
+  // expand term into leaves which are not linear combinations themselves
+  inline void CollectLinearTerms (const LinearTerm & term, std::vector<LinearTerm> & leaves)
+  {
+    std::vector<LinearTerm> sub;
+    if (!term.func->linearTerms(sub))
+      {
+        leaves.push_back(term);
+        return;
+      }
+
+    for (auto & t : sub)
+      {
+        LinearTerm leaf { term.fac * t.fac, term.params, t.func };
+        leaf.params.insert(leaf.params.end(), t.params.begin(), t.params.end());
+        CollectLinearTerms(leaf, leaves);
+      }
+  }
+
+
+  /*
+    Rewrite a built graph for cheaper evaluation: nested SumFunction and
+    ScaleFunction chains become one flat LinearCombinationFunction, equal
+    leaves are merged, compositions with an IdentityFunction are dropped,
+    and x-independent subgraphs are wrapped into a CachedFunction. The
+    Parameters stay symbolic, so the result follows later Parameter::set
+    calls just like the original graph.
+  */
+  inline std::shared_ptr<NonlinearFunction> Simplify (std::shared_ptr<NonlinearFunction> func)
+  {
+    if (auto comp = std::dynamic_pointer_cast<ComposeFunction>(func))
+      {
+        auto outer = Simplify(comp->outer());
+        auto inner = Simplify(comp->inner());
+        if (dynamic_cast<IdentityFunction*>(outer.get())) return inner;
+        if (dynamic_cast<IdentityFunction*>(inner.get())) return outer;
+        return Compose(outer, inner);
+      }
+
+    std::vector<LinearTerm> terms;
+    CollectLinearTerms({1, {}, func}, terms);
+    if (terms.size() == 1 && terms[0].fac == 1 && terms[0].params.empty())
+      return func;
+
+    std::vector<LinearTerm> leaves;
+    for (auto t : terms)
+      {
+        t.func = Simplify(t.func);
+        CollectLinearTerms(t, leaves);
+      }
+
+    std::vector<LinearTerm> merged;
+    for (auto & t : leaves)
+      {
+        auto same = std::find_if(merged.begin(), merged.end(), [&](const LinearTerm & m)
+        {
+          return m.func == t.func && m.params == t.params;
+        });
+        if (same != merged.end())
+          same->fac += t.fac;
+        else
+          merged.push_back(t);
+      }
+
+    for (auto & t : merged)
+      if (t.func->isConstant() &&
+          !dynamic_cast<ConstantFunction*>(t.func.get()) &&
+          !dynamic_cast<CachedFunction*>(t.func.get()))
+        t.func = std::make_shared<CachedFunction>(t.func);
+
+    return std::make_shared<LinearCombinationFunction>(merged);
+  }
+
+}
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef SPARSEMATRIX_HPP
+#define SPARSEMATRIX_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include <vector.hpp>
+#include <matrix.hpp>
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+  // number of nonzero diagonals below and above the main diagonal
+  struct Bandwidth
+  {
+    size_t lower = 0, upper = 0;
+  };
+
+  // column numbers of the (structurally) nonzero entries, row by row
+  class SparsityPattern
+  {
+    size_t m_width;
+    std::vector<std::vector<size_t>> m_rows;
+  public:
+    SparsityPattern (size_t height, size_t width)
+      : m_width(width), m_rows(height) { }
+
+    size_t height() const { return m_rows.size(); }
+    size_t width() const { return m_width; }
+    const std::vector<size_t> & row (size_t i) const { return m_rows[i]; }
+
+    void add (size_t i, size_t j) { m_rows[i].push_back(j); }
+
+    void addBlock (size_t firsti, size_t nexti, size_t firstj, size_t nextj)
+    {
+      for (size_t i = firsti; i < nexti; i++)
+        for (size_t j = firstj; j < nextj; j++)
+          m_rows[i].push_back(j);
+    }
+
+    void addDiag (size_t first, size_t next, size_t offi = 0, size_t offj = 0)
+    {
+      for (size_t i = first; i < next; i++)
+        m_rows[offi+i].push_back(offj+i);
+    }
+
+    // add the pattern p, shifted by offi rows and offj columns
+    void add (const SparsityPattern & p, size_t offi = 0, size_t offj = 0)
+    {
+      for (size_t i = 0; i < p.height(); i++)
+        for (size_t j : p.row(i))
+          m_rows[offi+i].push_back(offj+j);
+    }
+
+    // same size and entries, for finalized patterns
+    bool operator== (const SparsityPattern & p) const
+    {
+      return m_width == p.m_width && m_rows == p.m_rows;
+    }
+
+    // sort the rows and remove duplicates
+    void finalize()
+    {
+      for (auto & r : m_rows)
+        {
+          std::sort (r.begin(), r.end());
+          r.erase (std::unique (r.begin(), r.end()), r.end());
+        }
+    }
+
+    size_t nze() const
+    {
+      size_t sum = 0;
+      for (auto & r : m_rows) sum += r.size();
+      return sum;
+    }
+
+    Bandwidth bandwidth() const
+    {
+      Bandwidth bw;
+      for (size_t i = 0; i < m_rows.size(); i++)
+        for (size_t j : m_rows[i])
+          {
+            if (j < i) bw.lower = std::max(bw.lower, i-j);
+            else bw.upper = std::max(bw.upper, j-i);
+          }
+      return bw;
+    }
+  };
+
+  // pattern of the product a*b
+  inline SparsityPattern MultPattern (const SparsityPattern & a, const SparsityPattern & b)
+  {
+    SparsityPattern ab(a.height(), b.width());
+    for (size_t i = 0; i < a.height(); i++)
+      for (size_t k : a.row(i))
+        for (size_t j : b.row(k))
+          ab.add(i, j);
+    ab.finalize();
+    return ab;
+  }
+
+
+  // Sparse matrix in compressed row storage. The pattern is fixed at
+  // construction, only the values change afterwards.
+  class SparseMatrix
+  {
+    size_t m_height, m_width;
+    std::vector<size_t> m_firsti;
+    std::vector<size_t> m_colnr;
+    std::vector<double> m_val;
+  public:
+    SparseMatrix (SparsityPattern pattern)
+      : m_height(pattern.height()), m_width(pattern.width()), m_firsti(pattern.height()+1)
+    {
+      pattern.finalize();
+      m_firsti[0] = 0;
+      for (size_t i = 0; i < m_height; i++)
+        m_firsti[i+1] = m_firsti[i] + pattern.row(i).size();
+      m_colnr.reserve(m_firsti[m_height]);
+      for (size_t i = 0; i < m_height; i++)
+        m_colnr.insert (m_colnr.end(), pattern.row(i).begin(), pattern.row(i).end());
+      m_val.assign(m_colnr.size(), 0.0);
+    }
+
+    size_t height() const { return m_height; }
+    size_t width() const { return m_width; }
+    size_t nze() const { return m_val.size(); }
+
+    size_t firstInRow (size_t i) const { return m_firsti[i]; }
+    size_t nextInRow (size_t i) const { return m_firsti[i+1]; }
+    size_t colNr (size_t k) const { return m_colnr[k]; }
+    double & value (size_t k) { return m_val[k]; }
+    double value (size_t k) const { return m_val[k]; }
+
+    // position of entry (i,j) in the value array, or -1 if not in the pattern
+    std::ptrdiff_t position (size_t i, size_t j) const
+    {
+      auto first = m_colnr.begin()+m_firsti[i];
+      auto next = m_colnr.begin()+m_firsti[i+1];
+      auto pos = std::lower_bound (first, next, j);
+      if (pos == next || *pos != j) return -1;
+      return pos - m_colnr.begin();
+    }
+
+    double & operator() (size_t i, size_t j)
+    {
+      auto pos = position(i, j);
+      if (pos < 0) throw std::out_of_range("SparseMatrix: entry not in pattern");
+      return m_val[pos];
+    }
+
+    double operator() (size_t i, size_t j) const
+    {
+      auto pos = position(i, j);
+      return (pos < 0) ? 0.0 : m_val[pos];
+    }
+
+    SparseMatrix & operator= (double val)
+    {
+      std::fill (m_val.begin(), m_val.end(), val);
+      return *this;
+    }
+
+    SparseMatrix & operator*= (double fac)
+    {
+      for (auto & v : m_val) v *= fac;
+      return *this;
+    }
+
+    // this += fac * b, with b shifted by offi rows and offj columns.
+    // The pattern of b must be contained in the pattern of this matrix.
+    void addScaled (double fac, const SparseMatrix & b, size_t offi = 0, size_t offj = 0)
+    {
+      for (size_t i = 0; i < b.height(); i++)
+        {
+          size_t k = m_firsti[offi+i];
+          for (size_t kb = b.m_firsti[i]; kb < b.m_firsti[i+1]; kb++)
+            {
+              size_t j = offj + b.m_colnr[kb];
+              while (k < m_firsti[offi+i+1] && m_colnr[k] < j) k++;
+              if (k == m_firsti[offi+i+1] || m_colnr[k] != j)
+                throw std::out_of_range("SparseMatrix: entry not in pattern");
+              m_val[k] += fac * b.m_val[kb];
+            }
+        }
+    }
+
+    // this += a * b
+    void addMult (const SparseMatrix & a, const SparseMatrix & b)
+    {
+      for (size_t i = 0; i < a.height(); i++)
+        for (size_t ka = a.m_firsti[i]; ka < a.m_firsti[i+1]; ka++)
+          {
+            size_t k = a.m_colnr[ka];
+            double aik = a.m_val[ka];
+            for (size_t kb = b.m_firsti[k]; kb < b.m_firsti[k+1]; kb++)
+              (*this)(i, b.m_colnr[kb]) += aik * b.m_val[kb];
+          }
+    }
+
+    // copy the entries within the pattern from a dense matrix
+    void setFromDense (MatrixView<double> dense)
+    {
+      for (size_t i = 0; i < m_height; i++)
+        for (size_t k = m_firsti[i]; k < m_firsti[i+1]; k++)
+          m_val[k] = dense(i, m_colnr[k]);
+    }
+
+    void toDense (MatrixView<double> dense) const
+    {
+      dense = 0.0;
+      for (size_t i = 0; i < m_height; i++)
+        for (size_t k = m_firsti[i]; k < m_firsti[i+1]; k++)
+          dense(i, m_colnr[k]) = m_val[k];
+    }
+
+    // y = A x
+    void mult (VectorView<double> x, VectorView<double> y) const
+    {
+      for (size_t i = 0; i < m_height; i++)
+        {
+          double sum = 0;
+          for (size_t k = m_firsti[i]; k < m_firsti[i+1]; k++)
+            sum += m_val[k] * x(m_colnr[k]);
+          y(i) = sum;
+        }
+    }
+  };
+
+}
+
+#endif
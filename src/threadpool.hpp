@@ -0,0 +1,143 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ASC_ode
+{
+
+  // Fixed set of worker threads, started once and reused for every parallel
+  // loop, so a loop per Newton iteration does not pay for thread creation.
+  class ThreadPool
+  {
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex, m_submit;
+    std::condition_variable m_wake, m_done;
+
+    std::function<void(size_t,size_t)> m_task;
+    size_t m_n = 0;
+    std::atomic<size_t> m_next{0};
+    size_t m_generation = 0;
+    size_t m_busy = 0;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+
+    static bool & insideTask()
+    {
+      static thread_local bool inside = false;
+      return inside;
+    }
+
+    // claim indices until the loop is exhausted
+    void work (size_t thread)
+    {
+      insideTask() = true;
+      for (size_t i = m_next++; i < m_n; i = m_next++)
+        try
+          {
+            m_task(i, thread);
+          }
+        catch (...)
+          {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error) m_error = std::current_exception();
+            m_next = m_n;
+          }
+      insideTask() = false;
+    }
+
+    void workerLoop (size_t thread)
+    {
+      size_t seen = 0;
+      while (true)
+        {
+          {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+            if (m_stop) return;
+            seen = m_generation;
+          }
+          work(thread);
+          {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busy == 0) m_done.notify_one();
+          }
+        }
+    }
+
+  public:
+    ThreadPool (size_t numthreads = std::thread::hardware_concurrency())
+    {
+      for (size_t t = 1; t < numthreads; t++)
+        m_workers.emplace_back([this, t] { workerLoop(t); });
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+      }
+      m_wake.notify_all();
+      for (auto & w : m_workers)
+        w.join();
+    }
+
+    ThreadPool (const ThreadPool &) = delete;
+    ThreadPool & operator= (const ThreadPool &) = delete;
+
+    // the calling thread takes part as thread 0
+    size_t numThreads() const { return m_workers.size()+1; }
+
+    // func(i, thread) for i = 0 ... n-1 with thread < numThreads(), returns
+    // when all calls are done. Loops started from inside a task run serially.
+    void parallelFor (size_t n, std::function<void(size_t,size_t)> func)
+    {
+      if (m_workers.empty() || n <= 1 || insideTask())
+        {
+          for (size_t i = 0; i < n; i++)
+            func(i, 0);
+          return;
+        }
+
+      std::lock_guard<std::mutex> submit(m_submit);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = func;
+        m_n = n;
+        m_next = 0;
+        m_busy = m_workers.size();
+        m_error = nullptr;
+        m_generation++;
+      }
+      m_wake.notify_all();
+      work(0);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [&] { return m_busy == 0; });
+      m_task = nullptr;
+      if (m_error)
+        std::rethrow_exception(m_error);
+    }
+  };
+
+
+  // below this many unknowns a parallel loop costs more than it saves
+  constexpr size_t ParallelMinDim = 32;
+
+  // one pool for the whole program, started on first use
+  inline ThreadPool & DefaultThreadPool()
+  {
+    static ThreadPool pool;
+    return pool;
+  }
+
+}
+
+#endif
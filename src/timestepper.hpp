@@ -3,8 +3,11 @@
 
 #include <functional>
 #include <exception>
+#include <stdexcept>
 
 #include "Newton.hpp"
+#include "nonlinexpr.hpp"
+#include "simplify.hpp"
 
 
 namespace ASC_ode
@@ -18,33 +21,155 @@ namespace ASC_ode
     TimeStepper(std::shared_ptr<NonlinearFunction> rhs) : m_rhs(rhs) {}
     virtual ~TimeStepper() = default;
     virtual void doStep(double tau, VectorView<double> y) = 0;
+
+    // one step which may fail, e.g. if Newton does not converge; then y
+    // is left unchanged and false is returned
+    virtual bool tryStep(double tau, VectorView<double> y)
+    {
+      doStep(tau, y);
+      return true;
+    }
+
+    // advance N independent states, stored as the columns of y (dimX() x N);
+    // the default steps column by column
+    virtual void doStepBatch(double tau, MatrixView<double> y)
+    {
+      Vector<> yj(y.rows());
+      for (size_t j = 0; j < y.cols(); j++)
+        {
+          yj = y.col(j);
+          doStep(tau, yj);
+          y.col(j) = yj;
+        }
+    }
+
+    // keep the end points of every step for denseOutput
+    void enableDenseOutput(bool enable = true) { m_denseoutput = enable; }
+
+    // y at t + theta tau, 0 <= theta <= 1, where the last doStep went from
+    // t to t+tau: cubic Hermite interpolation of y and y' = f(y) at both
+    // ends, of fourth order in tau. The two rhs values are computed on the
+    // first call after a step.
+    virtual void denseOutput(double theta, VectorView<double> y)
+    {
+      if (!m_denseoutput || m_densetau == 0)
+        throw std::logic_error("denseOutput: enableDenseOutput and doStep first");
+      size_t n = y.size();
+      auto y0 = ScratchVector(m_dense[0], n);
+      auto f0 = ScratchVector(m_dense[1], n);
+      auto y1 = ScratchVector(m_dense[2], n);
+      auto f1 = ScratchVector(m_dense[3], n);
+      if (!m_densef)
+        {
+          m_rhs->evaluate(y0, f0);
+          m_rhs->evaluate(y1, f1);
+          m_densef = true;
+        }
+
+      double t = theta, tau = m_densetau;
+      double h00 = (1+2*t)*(1-t)*(1-t), h10 = t*(1-t)*(1-t);
+      double h01 = t*t*(3-2*t), h11 = t*t*(t-1);
+      for (size_t l = 0; l < n; l++)
+        y(l) = h00*y0(l) + h01*y1(l) + tau * (h10*f0(l) + h11*f1(l));
+    }
+
+  protected:
+    bool m_denseoutput = false;
+    double m_densetau = 0;
+    bool m_densef = false;                // f0, f1 are computed
+    std::vector<double> m_dense[4];       // y0, f0, y1, f1 of the last step
+
+    // doStep calls these with y before and after the step
+    void beginStep(VectorView<double> y)
+    {
+      if (m_denseoutput)
+        ScratchVector(m_dense[0], y.size()) = y;
+    }
+    void endStep(double tau, VectorView<double> y)
+    {
+      if (!m_denseoutput) return;
+      ScratchVector(m_dense[2], y.size()) = y;
+      m_densetau = tau;
+      m_densef = false;
+    }
+
+    // the step from t to t+tau, split into halves wherever tryStep fails,
+    // at most maxhalvings times; if that fails too, y is left unchanged
+    void stepWithHalving(double tau, VectorView<double> y, int maxhalvings = 10)
+    {
+      if (tryStep(tau, y)) return;
+      if (maxhalvings == 0)
+        throw std::domain_error("time step failed after repeated step size halving");
+      Vector<> y0 = y;
+      try
+        {
+          stepWithHalving(0.5*tau, y, maxhalvings-1);
+          stepWithHalving(0.5*tau, y, maxhalvings-1);
+        }
+      catch (std::domain_error &)
+        {
+          y = y0;
+          throw;
+        }
+    }
   };
 
+  // z = x + fac * y for a batch of states; the inner loop runs over the
+  // instances, which are contiguous in memory
+  inline void BatchUpdate (MatrixView<double> z, MatrixView<double> x,
+                           double fac, MatrixView<double> y)
+  {
+    for (size_t i = 0; i < z.rows(); i++)
+      for (size_t j = 0; j < z.cols(); j++)
+        z(i,j) = x(i,j) + fac * y(i,j);
+  }
+
   class ExplicitEuler : public TimeStepper
   {
     Vector<> m_vecf;
+    std::vector<double> m_batchf;
   public:
     ExplicitEuler(std::shared_ptr<NonlinearFunction> rhs) 
     : TimeStepper(rhs), m_vecf(rhs->dimF()) {}
     void doStep(double tau, VectorView<double> y) override
     {
+      beginStep(y);
       this->m_rhs->evaluate(y, m_vecf);
       y += tau * m_vecf;
+      endStep(tau, y);
+    }
+    void doStepBatch(double tau, MatrixView<double> y) override
+    {
+      auto f = ScratchMatrix(m_batchf, y.rows(), y.cols());
+      m_rhs->evaluateBatch(y, f);
+      BatchUpdate(y, y, tau, f);
     }
   };
 
   class ImprovedEuler : public TimeStepper
   {
-    Vector<> m_vecf;
+    Vector<> m_vecf, m_ytilde;
+    std::vector<double> m_batchf, m_batchy;
   public:
     ImprovedEuler(std::shared_ptr<NonlinearFunction> rhs) 
-    : TimeStepper(rhs), m_vecf(rhs->dimF()) {}
+    : TimeStepper(rhs), m_vecf(rhs->dimF()), m_ytilde(rhs->dimX()) {}
     void doStep(double tau, VectorView<double> y) override
     {
-      Vector<double> y_tilde(y.size());
-      y_tilde = y + 0.5 *tau * m_vecf;
-      this->m_rhs->evaluate(y_tilde, m_vecf);
+      beginStep(y);
+      this->m_rhs->evaluate(y, m_vecf);
+      m_ytilde = y + 0.5 *tau * m_vecf;
+      this->m_rhs->evaluate(m_ytilde, m_vecf);
       y += tau * m_vecf;
+      endStep(tau, y);
+    }
+    void doStepBatch(double tau, MatrixView<double> y) override
+    {
+      auto f = ScratchMatrix(m_batchf, y.rows(), y.cols());
+      auto y_tilde = ScratchMatrix(m_batchy, y.rows(), y.cols());
+      m_rhs->evaluateBatch(y, f);
+      BatchUpdate(y_tilde, y, 0.5*tau, f);
+      m_rhs->evaluateBatch(y_tilde, f);
+      BatchUpdate(y, y, tau, f);
     }
   };
 
@@ -53,117 +178,283 @@ namespace ASC_ode
     std::shared_ptr<NonlinearFunction> m_equ;
     std::shared_ptr<Parameter> m_tau;
     std::shared_ptr<ConstantFunction> m_yold;
+    Newton m_newton;
   public:
     ImplicitEuler(std::shared_ptr<NonlinearFunction> rhs) 
     : TimeStepper(rhs), m_tau(std::make_shared<Parameter>(0.0)) 
     {
       m_yold = std::make_shared<ConstantFunction>(rhs->dimX());
       auto ynew = std::make_shared<IdentityFunction>(rhs->dimX());
-      m_equ = ynew - m_yold - m_tau * m_rhs;
+      m_equ = MakeExprFunction(Expr(ynew) - m_yold - m_tau * Expr(m_rhs));
     }
 
     void doStep(double tau, VectorView<double> y) override
+    {
+      beginStep(y);
+      stepWithHalving(tau, y);
+      endStep(tau, y);
+    }
+
+    bool tryStep(double tau, VectorView<double> y) override
     {
       m_yold->set(y);
       m_tau->set(tau);
-      NewtonSolver(m_equ, y);
+      return m_newton.trySolve(m_equ, y) == NewtonStatus::Converged;
     }
+
+    // solver settings, e.g. the Jacobian refresh rule
+    Newton & newton() { return m_newton; }
   };
-    class RungeKutta2 : public TimeStepper
+  /*
+    Explicit Runge-Kutta method from a Butcher tableau, a strictly lower
+    triangular. The stages live in one array allocated with the stepper.
+    Every stage argument y + tau sum_j a_ij k_j and the update
+    y += tau sum_i b_i k_i is formed in a single pass over the state,
+    with vanishing coefficients skipped, so a step allocates nothing.
+  */
+  class ExplicitRungeKutta : public TimeStepper
   {
+  protected:
+    size_t m_stages, m_n;
+    std::vector<double> m_a, m_b, m_c;
+    std::vector<double> m_k;        // stage i at i*m_n
+    Vector<> m_ytmp;
+    std::vector<double> m_weights;
+    std::vector<const double*> m_terms;
+
+    VectorView<double> stage (size_t i) { return VectorView<double>(m_n, m_k.data()+i*m_n); }
+
+    // z = y + tau sum_j w[j] k_j over the first num stages, z may be y
+    void combine (VectorView<double> z, VectorView<double> y, double tau,
+                  const double * w, size_t num)
+    {
+      size_t nterms = 0;
+      for (size_t j = 0; j < num; j++)
+        if (w[j] != 0)
+          {
+            m_weights[nterms] = tau * w[j];
+            m_terms[nterms++] = m_k.data()+j*m_n;
+          }
+      for (size_t l = 0; l < m_n; l++)
+        {
+          double sum = y(l);
+          for (size_t q = 0; q < nterms; q++)
+            sum += m_weights[q] * m_terms[q][l];
+          z(l) = sum;
+        }
+    }
+
+    // stages first ... m_stages-1, the stages before first are given
+    void computeStages (double tau, VectorView<double> y, size_t first = 0)
+    {
+      if (first == 0)
+        {
+          m_rhs->evaluate(y, stage(0));
+          first = 1;
+        }
+      for (size_t i = first; i < m_stages; i++)
+        {
+          combine(m_ytmp, y, tau, &m_a[i*m_stages], i);
+          m_rhs->evaluate(m_ytmp, stage(i));
+        }
+    }
+
   public:
-    using TimeStepper::TimeStepper;
+    ExplicitRungeKutta (std::shared_ptr<NonlinearFunction> rhs,
+                        const Matrix<> & a, const Vector<> & b, const Vector<> & c)
+      : TimeStepper(rhs), m_stages(c.size()), m_n(rhs->dimX()),
+        m_a(m_stages*m_stages), m_b(m_stages), m_c(m_stages),
+        m_k(m_stages*m_n), m_ytmp(m_n), m_weights(m_stages), m_terms(m_stages)
+    {
+      for (size_t i = 0; i < m_stages; i++)
+        {
+          for (size_t j = 0; j < m_stages; j++)
+            m_a[i*m_stages+j] = a(i,j);
+          m_b[i] = b(i);
+          m_c[i] = c(i);
+        }
+      for (size_t i = 0; i < m_stages; i++)
+        for (size_t j = i; j < m_stages; j++)
+          if (m_a[i*m_stages+j] != 0)
+            throw std::invalid_argument("ExplicitRungeKutta: a must be strictly lower triangular");
+    }
+
+    size_t stages() const { return m_stages; }
+    size_t dimX() const { return m_n; }
 
     void doStep(double tau, VectorView<double> y) override
     {
-      const size_t n = m_rhs->dimX();
-
-      Vector<double> k1(n);
-      Vector<double> k2(n);
-      Vector<double> ytmp(n);
+      beginStep(y);
+      computeStages(tau, y);
+      combine(y, y, tau, m_b.data(), m_stages);
+      endStep(tau, y);
+    }
+  };
 
-      // k1 = f(y_n)
-      m_rhs->evaluate(y, k1);
 
-      // ytmp = y_n + (tau/2) * k1
-      for (size_t i = 0; i < n; ++i)
-        ytmp(i) = y(i) + 0.5 * tau * k1(i);
+  // explicit midpoint rule
+  class RungeKutta2 : public ExplicitRungeKutta
+  {
+    std::vector<double> m_batchk, m_batchy;
+  public:
+    RungeKutta2(std::shared_ptr<NonlinearFunction> rhs)
+      : ExplicitRungeKutta(rhs, Matrix<>{ { 0, 0 }, { 0.5, 0 } },
+                           Vector<>{ 0, 1 }, Vector<>{ 0, 0.5 }) { }
 
-      // k2 = f(y_n + tau/2 * k1)
-      m_rhs->evaluate(ytmp, k2);
+    void doStepBatch(double tau, MatrixView<double> y) override
+    {
+      auto k = ScratchMatrix(m_batchk, y.rows(), y.cols());
+      auto ytmp = ScratchMatrix(m_batchy, y.rows(), y.cols());
 
-      // y_{n+1} = y_n + tau * k2
-      for (size_t i = 0; i < n; ++i)
-        y(i) += tau * k2(i);
+      m_rhs->evaluateBatch(y, k);
+      BatchUpdate(ytmp, y, 0.5*tau, k);
+      m_rhs->evaluateBatch(ytmp, k);
+      BatchUpdate(y, y, tau, k);
     }
   };
 
 
-  class RungeKutta4 : public TimeStepper
+  // classical fourth order Runge-Kutta method
+  class RungeKutta4 : public ExplicitRungeKutta
   {
+    std::vector<double> m_batchk[4], m_batchy;
   public:
-    using TimeStepper::TimeStepper;
+    RungeKutta4(std::shared_ptr<NonlinearFunction> rhs)
+      : ExplicitRungeKutta(rhs, Matrix<>{ { 0, 0, 0, 0 }, { 0.5, 0, 0, 0 },
+                                          { 0, 0.5, 0, 0 }, { 0, 0, 1, 0 } },
+                           Vector<>{ 1.0/6, 1.0/3, 1.0/3, 1.0/6 },
+                           Vector<>{ 0, 0.5, 0.5, 1 }) { }
 
-    void doStep(double tau, VectorView<double> y) override
+    void doStepBatch(double tau, MatrixView<double> y) override
     {
-      const size_t n = m_rhs->dimX();
+      size_t n = y.rows(), N = y.cols();
+      auto k1 = ScratchMatrix(m_batchk[0], n, N);
+      auto k2 = ScratchMatrix(m_batchk[1], n, N);
+      auto k3 = ScratchMatrix(m_batchk[2], n, N);
+      auto k4 = ScratchMatrix(m_batchk[3], n, N);
+      auto ytmp = ScratchMatrix(m_batchy, n, N);
 
-      Vector<double> k1(n);
-      Vector<double> k2(n);
-      Vector<double> k3(n);
-      Vector<double> k4(n);
-      Vector<double> ytmp(n);
+      m_rhs->evaluateBatch(y, k1);
+      BatchUpdate(ytmp, y, 0.5*tau, k1);
+      m_rhs->evaluateBatch(ytmp, k2);
+      BatchUpdate(ytmp, y, 0.5*tau, k2);
+      m_rhs->evaluateBatch(ytmp, k3);
+      BatchUpdate(ytmp, y, tau, k3);
+      m_rhs->evaluateBatch(ytmp, k4);
 
-      // k1 = f(y_n)
-      m_rhs->evaluate(y, k1);
-
-      // k2 = f(y_n + tau/2 * k1)
       for (size_t i = 0; i < n; ++i)
-        ytmp(i) = y(i) + 0.5 * tau * k1(i);
-      m_rhs->evaluate(ytmp, k2);
+        for (size_t j = 0; j < N; ++j)
+          y(i,j) += (tau / 6.0) *
+                    (k1(i,j) + 2.0 * k2(i,j) + 2.0 * k3(i,j) + k4(i,j));
+    }
+  };
 
-      // k3 = f(y_n + tau/2 * k2)
-      for (size_t i = 0; i < n; ++i)
-        ytmp(i) = y(i) + 0.5 * tau * k2(i);
-      m_rhs->evaluate(ytmp, k3);
+  /*
+    Low-storage Runge-Kutta method in Williamson's 2N form, every stage does
+      dq = A_i dq + tau f(y),   y += B_i dq.
+    The scheme itself needs only y and dq. Since evaluate overwrites its
+    output, f(y) takes a third vector, so the stepper keeps dq and f
+    besides y, independent of the number of stages, where the tableau
+    RK4 keeps four stages and a temporary.
+  */
+  class LowStorageRungeKutta : public TimeStepper
+  {
+    std::vector<double> m_A, m_B;
+    Vector<> m_dq, m_f;
+  public:
+    LowStorageRungeKutta(std::shared_ptr<NonlinearFunction> rhs,
+                         std::vector<double> A, std::vector<double> B)
+      : TimeStepper(rhs), m_A(A), m_B(B), m_dq(rhs->dimX()), m_f(rhs->dimF()) { }
 
-      // k4 = f(y_n + tau * k3)
-      for (size_t i = 0; i < n; ++i)
-        ytmp(i) = y(i) + tau * k3(i);
-      m_rhs->evaluate(ytmp, k4);
+    size_t stages() const { return m_A.size(); }
 
-      // y_{n+1} = y_n + tau/6 * (k1 + 2k2 + 2k3 + k4)
-      for (size_t i = 0; i < n; ++i)
-      {
-        y(i) += (tau / 6.0) *
-                (k1(i) + 2.0 * k2(i) + 2.0 * k3(i) + k4(i));
-      }
+    void doStep(double tau, VectorView<double> y) override
+    {
+      beginStep(y);
+      for (size_t i = 0; i < m_A.size(); i++)
+        {
+          m_rhs->evaluate(y, m_f);
+          double A = m_A[i], B = m_B[i];
+          if (i == 0)
+            for (size_t l = 0; l < y.size(); l++)
+              {
+                m_dq(l) = tau * m_f(l);
+                y(l) += B * m_dq(l);
+              }
+          else
+            for (size_t l = 0; l < y.size(); l++)
+              {
+                m_dq(l) = A * m_dq(l) + tau * m_f(l);
+                y(l) += B * m_dq(l);
+              }
+        }
+      endStep(tau, y);
     }
   };
 
+
+  // Williamson's third order scheme with 3 stages
+  class LowStorageRK3 : public LowStorageRungeKutta
+  {
+  public:
+    LowStorageRK3(std::shared_ptr<NonlinearFunction> rhs)
+      : LowStorageRungeKutta(rhs, { 0, -5.0/9, -153.0/128 },
+                             { 1.0/3, 15.0/16, 8.0/15 }) { }
+  };
+
+
+  // Carpenter and Kennedy's fourth order scheme with 5 stages
+  class LowStorageRK4 : public LowStorageRungeKutta
+  {
+  public:
+    LowStorageRK4(std::shared_ptr<NonlinearFunction> rhs)
+      : LowStorageRungeKutta(rhs,
+                             { 0,
+                               -567301805773.0/1357537059087,
+                               -2404267990393.0/2016746695238,
+                               -3550918686646.0/2091501179385,
+                               -1275806237668.0/842570457699 },
+                             { 1432997174477.0/9575080441755,
+                               5161836677717.0/13612068292357,
+                               1720146321549.0/2090206949498,
+                               3134564353537.0/4481467310338,
+                               2277821191437.0/14882151754819 }) { }
+  };
+
   class CrankNicolson : public TimeStepper
   {
     std::shared_ptr<NonlinearFunction> m_equ;
     std::shared_ptr<Parameter> m_tau;
     std::shared_ptr<ConstantFunction> m_yold;
+    Newton m_newton;
   public:
     CrankNicolson(std::shared_ptr<NonlinearFunction> rhs)
     : TimeStepper(rhs), m_tau(std::make_shared<Parameter>(0.0))
     {
       m_yold = std::make_shared<ConstantFunction>(rhs->dimX());
       auto ynew = std::make_shared<IdentityFunction>(rhs->dimX());
-      auto f_old = std::make_shared<ComposeFunction>(rhs, m_yold);
+      auto f_old = std::make_shared<CachedFunction>(Compose(rhs, m_yold));
 
-      m_equ = ynew - m_yold - m_tau * (f_old + m_rhs); 
+      m_equ = Simplify(ynew - m_yold - m_tau * (f_old + m_rhs));
     }
 
     void doStep(double tau, VectorView<double> y) override
+    {
+      beginStep(y);
+      stepWithHalving(tau, y);
+      endStep(tau, y);
+    }
+
+    bool tryStep(double tau, VectorView<double> y) override
     {
       m_yold->set(y);
       m_tau->set(0.5 * tau);
-      NewtonSolver(m_equ, y);
+      return m_newton.trySolve(m_equ, y) == NewtonStatus::Converged;
     }
 
+    // solver settings, e.g. the Jacobian refresh rule
+    Newton & newton() { return m_newton; }
+
   };
 }
 